@@ -43,9 +43,13 @@
 //
 // GitHub (source, support, etc.): https://github.com/626Pilot/RaspberryPi-NeoPixel-WS2812
 //    Buy WS2812-based stuff from: http://adafruit.com
-//                   Compile with: gcc ws2812-RPi.c -o ws2812-RPi
+//                   Compile with: make (or gcc ws2812-RPi.c -o ws2812-RPi -lm -lrt -lpthread)
 //                      Test with: sudo ./ws2812-RPi
 //                                 (it needs to be root so it can map the peripherals' registers)
+//        Test without a Pi/LEDs with: ./ws2812-RPi --simulate --repeat 1
+//                      As a daemon: sudo ./ws2812-RPi --daemon
+//                                 echo "fill 0 0 64" > /dev/ws2812; echo show > /dev/ws2812
+//                   Benchmark with: make bench
 //
 // =================================================================================================
 
@@ -115,6 +119,22 @@
 #include <time.h>
 #include <signal.h>
 #include <sys/file.h>	// Used for single instance check
+#include <getopt.h>
+#include <poll.h>		// Used by the FIFO daemon
+#include <sys/wait.h>
+#include <pthread.h>		// Worker threads
+#include <sys/socket.h>	// Used by the Open Pixel Control server
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ws2812-shm.h"	// Shared memory frame ring
+
+#if defined(__SSE2__)
+#include <emmintrin.h>	// SSE2 pixel encoder
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>	// NEON pixel encoder
+#include <sys/auxv.h>	// Used to check for NEON at runtime
+#endif
 
 
 
@@ -132,8 +152,11 @@
 // -------------------------------------------------------------------------------------------------
 #define DMA_BASE		0x20007000
 #define DMA_LEN			0x24
+#define DMA_CHANNEL_LEN	0x100				// Channels 0-14 follow one another, this far apart
 #define PWM_BASE		0x2020C000
 #define PWM_LEN			0x28
+#define PCM_BASE		0x20203000
+#define PCM_LEN			0x24
 #define CLK_BASE	    0x20101000
 #define CLK_LEN			0xA8
 #define GPIO_BASE		0x20200000
@@ -157,6 +180,8 @@
 // -------------------------------------------------------------------------------------------------
 #define	PWM_CLK_CNTL 	40		// Control (on/off)
 #define	PWM_CLK_DIV  	41		// Divisor (bits 11:0 are *quantized* floating part, 31:12 integer part)
+#define	PCM_CLK_CNTL 	38		// Same again, for the PCM clock
+#define	PCM_CLK_DIV  	39
 
 // PWM Register Addresses (page 141)
 // These are divided by 4 because the register offsets in the guide are in bytes (8 bits) but
@@ -236,6 +261,54 @@
 //				PWM_STA_FULL1 (FIFO full)
 //				PWM_CTL_CLRF1 (Clear FIFO)
 
+// Bus addresses of the FIFOs, for the DMA controller
+#define PWM_FIFO_BUS	(0x7E20C000 + PWM_FIF1 * 4)
+#define PCM_FIFO_BUS	(0x7E203000 + PCM_FIFO * 4)
+
+// PCM Register Addresses (page 125)
+// The PCM (I2S) controller can send 32-bit words one after another just like the PWM serializer,
+// from its own 64-word FIFO and with its own DMA request line. We only use its data out pin
+// (PCM_DOUT, GPIO21), with one 32-bit channel filling each 32-clock frame.
+// -------------------------------------------------------------------------------------------------
+#define PCM_CS		(0x00 / 4)	// Control & Status
+#define PCM_FIFO	(0x04 / 4)	// FIFO Data
+#define PCM_MODE	(0x08 / 4)	// Mode
+#define PCM_RXC		(0x0C / 4)	// Receive Configuration
+#define PCM_TXC		(0x10 / 4)	// Transmit Configuration
+#define PCM_DREQ	(0x14 / 4)	// DMA Request Levels
+#define PCM_INTEN	(0x18 / 4)	// Interrupt Enables
+#define PCM_INTSTC	(0x1C / 4)	// Interrupt Status & Clear
+#define PCM_GRAY	(0x20 / 4)	// Gray Mode Control
+
+// PCM_CS register bit offsets
+// -------------------------------------------------------------------------------------------------
+#define PCM_CS_STBY		25	// Take the FIFO RAMs out of standby
+#define PCM_CS_TXE		21	// TX FIFO is empty
+#define PCM_CS_TXERR	15	// TX FIFO ran dry (write 1 to clear)
+#define PCM_CS_DMAEN	9	// Send DMA requests
+#define PCM_CS_TXCLR	3	// Clear TX FIFO
+#define PCM_CS_TXON		2	// Start transmitting
+#define PCM_CS_RXON		1	// Start receiving
+#define PCM_CS_EN		0	// Enable PCM
+
+// PCM_MODE register bit offsets
+// -------------------------------------------------------------------------------------------------
+#define PCM_MODE_CLK_DIS	28	// Disable the clock
+#define PCM_MODE_FLEN		10	// Bits 19:10. Frame length, in clocks, minus one
+#define PCM_MODE_FSLEN		0	// Bits 9:0. Frame sync length, in clocks
+
+// PCM_TXC register bit offsets (channel 2's are the same, 16 bits down)
+// -------------------------------------------------------------------------------------------------
+#define PCM_TXC_CH1WEX		31	// Add 16 to channel 1's width
+#define PCM_TXC_CH1EN		30	// Enable channel 1
+#define PCM_TXC_CH1POS		20	// Bits 29:20. Clock in the frame channel 1 starts at
+#define PCM_TXC_CH1WID		16	// Bits 19:16. Channel 1 width, minus 8
+
+// PCM_DREQ register bit offsets
+// -------------------------------------------------------------------------------------------------
+#define PCM_DREQ_TX_PANIC	24	// Bits 30:24. Threshold for TX PANIC signal
+#define PCM_DREQ_TX			8	// Bits 14:8. Threshold for TX DREQ signal
+
 // DMA
 // --------------------------------------------------------------------------------------------------
 // DMA registers (divided by four to convert form word to byte offsets, as with the PWM registers)
@@ -296,13 +369,12 @@
 #define DMA_TI_WAIT_RESP		3		// Wait for write response
 #define DMA_TI_TDMODE			1		// 2D striding mode
 #define DMA_TI_INTEN			0		// Interrupt enable
-// Default TI word
+// Default TI word (add the output engine's DREQ << DMA_TI_PERMAP)
 #define DMA_TI_CONFIGWORD		(1 << DMA_TI_NO_WIDE_BURSTS) | \
 								(1 << DMA_TI_SRC_INC) | \
 								(1 << DMA_TI_DEST_DREQ) | \
 								(1 << DMA_TI_WAIT_RESP) | \
-								(1 << DMA_TI_INTEN) | \
-								(DMA_DREQ_PWM << DMA_TI_PERMAP)
+								(1 << DMA_TI_INTEN)
 
 // DMA Debug register bit offsets
 #define DMA_DEBUG_LITE					28		// Whether the controller is "Lite"
@@ -339,31 +411,86 @@ page_map_t *page_map;						// This will hold the page map, which we'll allocate
 static uint8_t *virtbase;					// Pointer to some virtual memory that will be allocated
 
 static volatile unsigned int *pwm_reg;		// PWM controller register set
+static volatile unsigned int *pcm_reg;		// PCM controller register set
 static volatile unsigned int *clk_reg;		// PWM clock manager register set
 static volatile unsigned int *dma_reg;		// DMA controller register set
 static volatile unsigned int *gpio_reg;		// GPIO pin controller register set
 
-// Contains arrays of control blocks and their related samples.
-// One pixel needs 72 bits (24 bits for the color * 3 to represent them on the wire).
-// 		 768 words = 341.3 pixels
-// 		1024 words = 455.1 pixels
-// The highest I can make this number is 1016. Any higher, and it will start copying garbage to the
-// PWM controller. I think it might be because of the virtual->physical memory mapping not being
-// contiguous, so *pointer+1016 isn't "next door" to *pointer+1017 for some weird reason.
-// However, that's still enough for 451.5 color instructions! If someone has more pixels than that
-// to control, they can figure it out. I tried Hirst's message of having one CB per word, which
-// seems like it might fix that, but I couldn't figure it out.
-#define NUM_DATA_WORDS 1016
+// Set by --simulate. The registers above are then backed by ordinary memory, and a software DMA
+// engine stands in for the real one. See "Software-simulated peripherals" below.
+static unsigned char simulate;
+
+#define PAGE_SIZE	4096					// Size of a RAM page to be allocated
+#define PAGE_SHIFT	12						// This is used for address translation
+
+// How many pixels to drive (per strip), unless main() is told otherwise (--leds)
+#define DEFAULT_NUM_LEDS 24
+
+// The PWM controller has two channels: channel 1 on GPIO18 and channel 2 on GPIO19. Both can run
+// in serializer mode from the same FIFO, which hands its words out to them in turn. So one DMA
+// stream of interleaved words can drive two strips at once, in the time it takes to send one.
+#define MAX_STRIPS 2
+
+// Everything we need per strip lives in one page-aligned arena, sized by initHardware() for the
+// strip it's given:
+//		Control blocks (one per page of samples, 128 per page)
+//		Sample buffer 0 (starts on a page boundary)
+//		Sample buffer 1 (ditto)
+//		Pixel buffer (LEDBuffer)
+// One pixel needs 72 bits (24 bits for the color * 3 to represent them on the wire), which is 2.25
+// words. Add one more word so the PWM FIFO gets the message: "we're sending zeroes"
+//		 768 words = 341.3 pixels
+//		1024 words = 455.1 pixels (one page)
+// The pages we allocate aren't physically contiguous, so the DMA controller can't just run from
+// one page into the next. (That's why the old single-CB version sent garbage past 1016 words.)
+// Instead, each page of samples gets its own control block. The CBs are chained together through
+// their "next" fields, so the DMA controller hops from page to page as it goes. There are two sets
+// of samples (and CB chains), so show() can fill one while DMA sends the other.
+#define NUM_BUFFERS			2
 struct control_data_s {
-	dma_cb_t cb[1];
-	uint32_t sample[NUM_DATA_WORDS];
+	dma_cb_t *cb[NUM_BUFFERS];			// Chain of control blocks for each sample buffer
+	uint32_t *sample[NUM_BUFFERS];		// Sample buffers (PWM waveform, in wire format)
 };
 
-static struct control_data_s *ctl;
+static struct control_data_s ctlData;
+static struct control_data_s *ctl = &ctlData;
 
-#define PAGE_SIZE	4096					// Size of a RAM page to be allocated
-#define PAGE_SHIFT	12						// This is used for address translation
-#define NUM_PAGES	((sizeof(struct control_data_s) + PAGE_SIZE - 1) >> PAGE_SHIFT)
+static unsigned int numSamplePages;		// Pages in each sample buffer
+static unsigned int numPages;			// Pages in the whole arena
+
+// Wire timing. The PWM clock is PLLC (1 GHz) divided by 400, so one wire bit (a third of a WS2812
+// bit) takes 0.4 μSec. WS2812s latch the colors they've received once the line has been low for
+// 50 μSec.
+#define PWM_CLK_IDIV	400
+#define WIRE_BIT_NS		400
+#define LATCH_NS		50000
+
+// Output engines. PWM is the original. PCM sends exactly the same bitstream out of PCM_DOUT
+// (GPIO21), which leaves the PWM free for audio, or for another copy of this driver running a
+// strip on GPIO18. Pick one (and a DMA channel, if the default is taken) before initHardware().
+typedef struct {
+	char *name;
+	unsigned int dreq;				// DMA request line that paces the transfer
+	uint32_t fifo;					// Bus address of the FIFO the DMA controller writes to
+	unsigned int fifoWords;			// How many words that FIFO holds
+	int dmaChannel;					// Default DMA channel
+	unsigned int clkDiv;			// Clock manager divisor register
+	unsigned int idleWords;			// Zero words sent after the pixels
+	unsigned int latchNs;			// How long the line has to stay low after those
+	char *lockFile;					// Only one process per engine!
+} OutputEngine_t;
+
+#define ENGINE_PWM	0
+#define ENGINE_PCM	1
+static const OutputEngine_t outputEngines[] = {
+	// The PWM serializer outputs zeroes once its FIFO runs dry, so one zero word gets the line low
+	// and we just wait for the latch.
+	{ "pwm", DMA_DREQ_PWM, PWM_FIFO_BUS, 16, 0, PWM_CLK_DIV, 1, LATCH_NS, "/var/run/ws2812-pwm.pid" },
+	// PCM flags a FIFO underrun instead, so we send the latch time as zeroes (4 words, rounded up).
+	{ "pcm", DMA_DREQ_PCM_TX, PCM_FIFO_BUS, 64, 10, PCM_CLK_DIV, 1 + (LATCH_NS + 32 * WIRE_BIT_NS - 1) / (32 * WIRE_BIT_NS), 0, "/var/run/ws2812-pcm.pid" }
+};
+static const OutputEngine_t *engine = &outputEngines[ENGINE_PWM];
+static int dmaChannel = -1;					// -1 means the engine's default
 
 #define SETBIT(word, bit) word |= 1<<bit
 #define CLRBIT(word, bit) word &= ~(1<<bit)
@@ -418,6 +545,13 @@ unsigned int reverseWord(unsigned int word) {
 	return output;
 }
 
+// Monotonic time in nanoseconds
+unsigned long long nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 // Not sure how this is better than usleep...?
 /*
 static void udelay(int us) {
@@ -429,7 +563,11 @@ static void udelay(int us) {
 
 // Shutdown functions
 // --------------------------------------------------------------------------------------------------
-static void terminate(int dummy) {
+void dumpSimulator();
+void dumpFrameStats();
+
+// Stop the DMA and PWM engines and free memory
+static void stopHardware() {
 	// Shut down the DMA controller
 	if(dma_reg) {
 		CLRBIT(dma_reg[DMA_CS], DMA_CS_ACTIVE);
@@ -438,18 +576,35 @@ static void terminate(int dummy) {
 		usleep(100);
 	}
 
-	// Shut down PWM
+	// Shut down PWM (or PCM)
 	if(pwm_reg) {
-		CLRBIT(pwm_reg[PWM_CTL], PWM_CTL_PWEN1);
+		pwm_reg[PWM_CTL] &= ~((1 << PWM_CTL_PWEN1) | (1 << PWM_CTL_PWEN2));
 		usleep(100);
 		pwm_reg[PWM_CTL] = (1 << PWM_CTL_CLRF1);
 	}
+	if(pcm_reg) {
+		CLRBIT(pcm_reg[PCM_CS], PCM_CS_TXON);
+		usleep(100);
+		pcm_reg[PCM_CS] = (1 << PCM_CS_TXCLR);
+	}
 	
 	// Free the allocated memory
 	if(page_map != 0) {
 		free(page_map);
+		page_map = 0;
 	}
+	if(virtbase != 0) {
+		munmap(virtbase, numPages * PAGE_SIZE);
+		virtbase = 0;
+	}
+}
 
+static void terminate(int dummy) {
+	if(simulate) {
+		dumpFrameStats();
+		dumpSimulator();
+	}
+	stopHardware();
 	exit(1);
 }
 
@@ -471,14 +626,14 @@ static unsigned int mem_virt_to_phys(void *virt) {
 }
 
 // Translate from physical address to virtual
-static unsigned int mem_phys_to_virt(uint32_t phys) {
+static void * mem_phys_to_virt(uint32_t phys) {
 	unsigned int pg_offset = phys & (PAGE_SIZE - 1);
 	unsigned int pg_addr = phys - pg_offset;
 	int i;
 
-	for (i = 0; i < NUM_PAGES; i++) {
+	for (i = 0; i < numPages; i++) {
 		if (page_map[i].physaddr == pg_addr) {
-			return (uint32_t)virtbase + i * PAGE_SIZE + pg_offset;
+			return virtbase + i * PAGE_SIZE + pg_offset;
 		}
 	}
 	fatal("Failed to reverse map phys addr %08x\n", phys);
@@ -487,10 +642,19 @@ static unsigned int mem_phys_to_virt(uint32_t phys) {
 }
 
 // Map a peripheral's IO memory into our virtual memory, so we can read/write it directly
+// (When simulating, the "registers" are just some zeroed memory.)
 static void * map_peripheral(uint32_t base, uint32_t len) {
-	int fd = open("/dev/mem", O_RDWR);
+	int fd;
 	void * vaddr;
 
+	if (simulate) {
+		vaddr = calloc(1, len);
+		if (vaddr == 0)
+			fatal("Failed to allocate simulated peripheral at 0x%08x: %m\n", base);
+		return vaddr;
+	}
+
+	fd = open("/dev/mem", O_RDWR);
 	if (fd < 0)
 		fatal("Failed to open /dev/mem: %m\n");
 	vaddr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, base);
@@ -515,22 +679,154 @@ static void * map_peripheral(uint32_t base, uint32_t len) {
 #define DEFAULT_BRIGHTNESS 1.0
 float brightness = DEFAULT_BRIGHTNESS;
 
-// LED buffer (this will be translated into pulses in PWMWaveform[])
+// Gamma correction - 1.0 is none. LEDs look more even from dark to light with 2.2 to 2.8.
+#define DEFAULT_GAMMA 1.0
+float colorGamma = DEFAULT_GAMMA;
+
+// White balance - how much of each channel to use for "full" red, green, or blue (0-1)
+float whiteBalance[3] = { 1.0, 1.0, 1.0 };
+
+// LED buffer (this will be translated into pulses in the DMA sample buffers)
 typedef struct {
 	unsigned char r;
 	unsigned char g;
 	unsigned char b;
 } Color_t;
 
-unsigned int numLEDs;		// How many LEDs there are on the chain
+unsigned int numLEDs;		// How many LEDs there are, on all strips (set by initHardware())
+unsigned int numStrips = 1;	// 1, or 2 when PWM channel 2 drives a second strip
+unsigned int stripLength;	// LEDs per strip. Pixels [stripLength, 2 * stripLength) go to strip 2.
+
+Color_t *LEDBuffer;			// numLEDs pixels, at the end of the DMA arena
+
+// The PWM waveform lives in the DMA sample buffers (ctl->sample), which are big enough for
+// numLEDs pixels. There's no separate staging copy: show() encodes straight into
+// whichever buffer isn't being sent, so each frame only goes through memory once.
+
+// Which DMA sample buffer show() fills next (the other one may be on the wire)
+static int backBuffer;
+
+// Return pointer to the PWM waveform sent last (what's on the strip, or on its way there)
+unsigned int* getPWMBuffer() {
+	return ctl->sample[(backBuffer + NUM_BUFFERS - 1) % NUM_BUFFERS];
+}
+
+// How many words we actually send for each strip: 2.25 words per pixel (rounded up), plus at least
+// one so the FIFO gets the message: "we're sending zeroes" (see outputEngines[])
+unsigned int stripWords() {
+	return ((stripLength * 9) + 3) / 4 + engine->idleWords;
+}
+
+// ...and for all of them. With two strips, the channels take turns, so their words are interleaved.
+unsigned int transferWords() {
+	return stripWords() * numStrips;
+}
+
+// Dirty pixel tracking
+// --------------------------------------------------------------------------------------------------
+// The setters note which pixels they changed, so show() only has to re-encode those. Ranges are
+// half-open ([first, end)); an empty one has first >= end. We keep one range per DMA buffer,
+// because show() alternates between them: a pixel changed for one frame still has to be written
+// into the other buffer when its turn comes around. A separate range covers what changed since
+// the last show(), which tells show() whether there's a new frame at all.
+
+typedef struct {
+	unsigned int first;
+	unsigned int end;
+} PixelRange_t;
+
+// initHardware() marks everything dirty, so the first show() sends the whole strip
+static PixelRange_t staleRange[NUM_BUFFERS];
+static PixelRange_t changedRange;
+
+static inline void growRange(PixelRange_t *range, unsigned int first, unsigned int end) {
+	if(range->first >= range->end) {
+		range->first = first;
+		range->end = end;
+		return;
+	}
+	if(first < range->first) {
+		range->first = first;
+	}
+	if(end > range->end) {
+		range->end = end;
+	}
+}
+
+// Note that pixels [first, first+count) need encoding again, although LEDBuffer didn't change
+// there (new color tables, say)
+static void growDirtyRanges(unsigned int first, unsigned int count) {
+	int i;
+	if(first >= numLEDs || count == 0) {
+		return;
+	}
+	if(count > numLEDs - first) {
+		count = numLEDs - first;
+	}
+	growRange(&changedRange, first, first + count);
+	for(i = 0; i < NUM_BUFFERS; i++) {
+		growRange(&staleRange[i], first, first + count);
+	}
+}
+
+void syncPixels16(unsigned int first, unsigned int count);
+
+// Note that pixels [first, first+count) of LEDBuffer changed. Call this after writing to
+// getPixels() directly. (If there are 16-bit pixels, those become the new 8-bit colors too.)
+void markPixelsDirty(unsigned int first, unsigned int count) {
+	syncPixels16(first, count);
+	growDirtyRanges(first, count);
+}
+
+// Color correction
+// --------------------------------------------------------------------------------------------------
+// Brightness, gamma and white balance all boil down to one 256-entry lookup table per channel,
+// which buildColorLUT() works out whenever one of them changes. The encoders look up every color
+// byte anyway, so applying the tables costs next to nothing, and LEDBuffer keeps the colors just
+// as they were set. (show() used to multiply every pixel by brightness in place, which darkened
+// the strip a bit more on each call.)
+unsigned char redLUT[256];
+unsigned char greenLUT[256];
+unsigned char blueLUT[256];
+unsigned char colorLUTIdentity = true;		// The tables don't change anything (so SIMD can skip them)
+static uint64_t colorLUTHash;				// The tables' hash, for the frame cache (0 = not worked out yet)
+
+void buildWireTables();
+void buildDitherLUT();
+
+void buildColorLUT() {
+	unsigned char *lut[3] = { redLUT, greenLUT, blueLUT };
+	int c, i;
+	float level;
+	unsigned char identity = true;
+
+	for(c=0; c<3; c++) {
+		for(i=0; i<256; i++) {
+			level = colorGamma == 1.0 ? i : 255.0 * powf(i / 255.0, colorGamma);
+			lut[c][i] = (unsigned char)(level * brightness * whiteBalance[c] + 0.5);
+			if(lut[c][i] != i) {
+				identity = false;
+			}
+		}
+	}
+	colorLUTIdentity = identity;
+	colorLUTHash = 0;
+	buildWireTables();
+	buildDitherLUT();
 
-#define LED_BUFFER_LENGTH 24
-Color_t LEDBuffer[LED_BUFFER_LENGTH];
+	// Every pixel's wire format just changed
+	growDirtyRanges(0, numLEDs);
+}
 
-// PWM waveform buffer (in words), 16 32-bit words are enough to hold 170 wire bits.
-// That's OK if we only transmit from the FIFO, but for DMA, we will use a much larger size.
-// 1024 (4096 bytes) should be enough for over 400 elements. It can be bumped up if you need more!
-unsigned int PWMWaveform[NUM_DATA_WORDS];
+// Run count pixels through the color correction tables
+static inline void applyColorLUT(Color_t *dest, Color_t *src, unsigned int count) {
+	int i;
+	for(i=0; i<count; i++) {
+		dest[i].r = redLUT[src[i].r];
+		dest[i].g = greenLUT[src[i].g];
+		dest[i].b = blueLUT[src[i].b];
+	}
+}
 
 // Set brightness
 unsigned char setBrightness(float b) {
@@ -542,23 +838,63 @@ unsigned char setBrightness(float b) {
 		printf("Brightness can't be set above 1.\n");
 		return false;
 	}
+	if(b == brightness) {
+		return true;			// Nothing to rebuild, and nothing to encode again
+	}
 	brightness = b;
+	buildColorLUT();
+	return true;
+}
+
+// Set gamma correction (1.0 = none)
+unsigned char setGamma(float g) {
+	if(g <= 0) {
+		printf("Gamma has to be above 0.\n");
+		return false;
+	}
+	if(g == colorGamma) {
+		return true;
+	}
+	colorGamma = g;
+	buildColorLUT();
+	return true;
+}
+
+// Set white balance (how much of each channel makes white, 0-1)
+unsigned char setWhiteBalance(float r, float g, float b) {
+	if(r < 0 || g < 0 || b < 0 || r > 1 || g > 1 || b > 1) {
+		printf("White balance has to be between 0 and 1.\n");
+		return false;
+	}
+	if(r == whiteBalance[0] && g == whiteBalance[1] && b == whiteBalance[2]) {
+		return true;
+	}
+	whiteBalance[0] = r;
+	whiteBalance[1] = g;
+	whiteBalance[2] = b;
+	buildColorLUT();
 	return true;
 }
 
-// Zero out the PWM waveform buffer
+// Zero out the PWM waveform buffers
 void clearPWMBuffer() {
-	memset(PWMWaveform, 0, NUM_DATA_WORDS * 4);	// Times four because memset deals in bytes.
+	int i;
+	for(i = 0; i < NUM_BUFFERS; i++) {
+		memset(ctl->sample[i], 0, numSamplePages * PAGE_SIZE);
+	}
+	// They don't match LEDBuffer any more, so show() has to encode everything again
+	growDirtyRanges(0, numLEDs);
 }
 
 // Zero out the LED buffer
 void clearLEDBuffer() {
 	int i;
-	for(i=0; i<LED_BUFFER_LENGTH; i++) {
+	for(i=0; i<numLEDs; i++) {
 		LEDBuffer[i].r = 0;
 		LEDBuffer[i].g = 0;
 		LEDBuffer[i].b = 0;
 	}
+	markPixelsDirty(0, numLEDs);
 }
 
 // Turn r, g, and b into a Color_t struct
@@ -573,57 +909,189 @@ Color_t Color(unsigned char r, unsigned char g, unsigned char b) {
 	return RGB2Color(r, g, b);
 }
 
-// Set pixel color (24-bit color)
-unsigned char setPixelColor(unsigned int pixel, unsigned char r, unsigned char g, unsigned char b) {
-	if(pixel < 0) {
-		printf("Unable to set pixel %d (less than zero?)\n", pixel);
-		return false;
-	}
-	if(pixel > LED_BUFFER_LENGTH - 1) {
-		printf("Unable to set pixel %d (LED buffer is %d pixels long)\n", pixel, LED_BUFFER_LENGTH);
-		return false;
+// Pixel access
+// --------------------------------------------------------------------------------------------------
+// The setters used to print a line for every pixel out of range, and stdout isn't buffered, so a
+// bad index in a loop meant a system call per pixel. Now they just return false. The range
+// functions check their arguments once per call, and return one of these to say what was wrong.
+typedef enum {
+	PIXEL_OK = 0,
+	PIXEL_OUT_OF_RANGE,			// Some of the pixels aren't in the LED buffer
+	PIXEL_BAD_ARGUMENT,			// A NULL pointer, or a gradient with fewer than 2 colors
+} PixelError_t;
+
+const char *pixelErrorString(PixelError_t error) {
+	switch(error) {
+		case PIXEL_OK:				return "OK";
+		case PIXEL_OUT_OF_RANGE:	return "pixels out of range";
+		case PIXEL_BAD_ARGUMENT:	return "bad argument";
 	}
-	LEDBuffer[pixel] = RGB2Color(r, g, b);
-	return true;
+	return "unknown error";
+}
+
+// Are pixels [first, first+count) all in the LED buffer? (Written so first + count can't overflow.)
+static inline PixelError_t checkPixelRange(unsigned int first, unsigned int count) {
+	return first <= numLEDs && count <= numLEDs - first ? PIXEL_OK : PIXEL_OUT_OF_RANGE;
 }
 
-// Set pixel color, by a direct Color_t
+// Set pixel color, by a direct Color_t. Returns false if it's not in the LED buffer.
 unsigned char setPixelColorT(unsigned int pixel, Color_t c) {
-	if(pixel < 0) {
-		printf("Unable to set pixel %d (less than zero?)\n", pixel);
+	if(pixel >= numLEDs) {
 		return false;
 	}
-	if(pixel > LED_BUFFER_LENGTH - 1) {
-		printf("Unable to set pixel %d (LED buffer is %d pixels long)\n", pixel, LED_BUFFER_LENGTH);
-		return false;
+	if(memcmp(&LEDBuffer[pixel], &c, sizeof(Color_t)) != 0) {
+		LEDBuffer[pixel] = c;
+		markPixelsDirty(pixel, 1);
+	} else {
+		syncPixels16(pixel, 1);		// It was set in 16 bits, maybe, but it's this 8-bit color now
 	}
-	LEDBuffer[pixel] = c;
 	return true;
 }
 
-// Get pixel color
+// Set pixel color (24-bit color)
+unsigned char setPixelColor(unsigned int pixel, unsigned char r, unsigned char g, unsigned char b) {
+	return setPixelColorT(pixel, RGB2Color(r, g, b));
+}
+
+// Get pixel color (black if it's not in the LED buffer)
 Color_t getPixelColor(unsigned int pixel) {
-	if(pixel < 0) {
-		printf("Unable to get pixel %d (less than zero?)\n", pixel);
-		return RGB2Color(0, 0, 0);
-	}
-	if(pixel > LED_BUFFER_LENGTH - 1) {
-		printf("Unable to get pixel %d (LED buffer is %d pixels long)\n", pixel, LED_BUFFER_LENGTH);
+	if(pixel >= numLEDs) {
 		return RGB2Color(0, 0, 0);
 	}
 	return LEDBuffer[pixel];
 }
 
+// For hot loops: no bounds check, and nothing is marked dirty. Check the range yourself first, and
+// call markPixelsDirty() for it when you're done.
+static inline void setPixelColorUnchecked(unsigned int pixel, Color_t c) {
+	LEDBuffer[pixel] = c;
+}
+
+static inline Color_t getPixelColorUnchecked(unsigned int pixel) {
+	return LEDBuffer[pixel];
+}
+
 // Return # of pixels
 unsigned int numPixels() {
 	return numLEDs;
 }
 
 // Return pointer to pixels (FIXME: dunno if this works!)
+// If you change pixels through this, call markPixelsDirty() for them, or show() won't notice.
 Color_t* getPixels() {
 	return LEDBuffer;
 }
 
+// Copy count pixels from src into pixels [first, first+count)
+PixelError_t setPixels(unsigned int first, unsigned int count, const Color_t *src) {
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(src == NULL && count > 0) {
+		return PIXEL_BAD_ARGUMENT;
+	}
+	if(count == 0 || memcmp(LEDBuffer + first, src, count * sizeof(Color_t)) == 0) {
+		syncPixels16(first, count);
+		return PIXEL_OK;
+	}
+	memmove(LEDBuffer + first, src, count * sizeof(Color_t));
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+// Set pixels [first, first+count) to one color
+PixelError_t fillPixels(unsigned int first, unsigned int count, Color_t c) {
+	Color_t *dest = LEDBuffer + first;
+	unsigned int done;
+
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(count == 0) {
+		return PIXEL_OK;
+	}
+	// Set one, then keep doubling what's there with memcpy() (3-byte pixels don't suit memset())
+	dest[0] = c;
+	for(done = 1; done < count; done *= 2) {
+		memcpy(dest + done, dest, (done < count - done ? done : count - done) * sizeof(Color_t));
+	}
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+// Copy count pixels from [src, src+count) to [dest, dest+count). They can overlap.
+PixelError_t copyPixels(unsigned int dest, unsigned int src, unsigned int count) {
+	if(checkPixelRange(dest, count) != PIXEL_OK || checkPixelRange(src, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(count == 0 || dest == src) {
+		return PIXEL_OK;
+	}
+	memmove(LEDBuffer + dest, LEDBuffer + src, count * sizeof(Color_t));
+	markPixelsDirty(dest, count);
+	return PIXEL_OK;
+}
+
+// Move pixels [first, first+count) along by places (towards the end if it's positive, towards the
+// start if it's negative). Pixels moved off the end are gone, and the ones left behind are set to c.
+PixelError_t shiftPixels(unsigned int first, unsigned int count, int places, Color_t c) {
+	unsigned int n = places < 0 ? -(unsigned int)places : (unsigned int)places;
+
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(n >= count) {
+		return fillPixels(first, count, c);
+	}
+	if(n == 0) {
+		return PIXEL_OK;
+	}
+	if(places > 0) {
+		memmove(LEDBuffer + first + n, LEDBuffer + first, (count - n) * sizeof(Color_t));
+		fillPixels(first, n, c);
+	} else {
+		memmove(LEDBuffer + first, LEDBuffer + first + n, (count - n) * sizeof(Color_t));
+		fillPixels(first + count - n, n, c);
+	}
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+static void reversePixels(Color_t *p, unsigned int count) {
+	Color_t t;
+	unsigned int i;
+
+	for(i = 0; i < count / 2; i++) {
+		t = p[i];
+		p[i] = p[count - 1 - i];
+		p[count - 1 - i] = t;
+	}
+}
+
+// Like shiftPixels(), but the pixels that go off one end come back on at the other
+PixelError_t rotatePixels(unsigned int first, unsigned int count, int places) {
+	Color_t *p = LEDBuffer + first;
+	unsigned int n;
+
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(count == 0) {
+		return PIXEL_OK;
+	}
+	// Rotating by n towards the end is the same as rotating by count - n towards the start
+	n = places < 0 ? count - (-(unsigned int)places % count) : (unsigned int)places % count;
+	if(n == 0 || n == count) {
+		return PIXEL_OK;
+	}
+	// Reverse the lot, then each part, and everything's where it should be. No copy needed.
+	reversePixels(p, count);
+	reversePixels(p, n);
+	reversePixels(p + n, count - n);
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
 // Set an individual bit in the PWM output array, accounting for word boundaries
 // The (31 - bitIdx) is so that we write the data backwards, correcting its endianness
 // This means getPWMBit will return something other than what was written, so it would be nice
@@ -633,6 +1101,7 @@ void setPWMBit(unsigned int bitPos, unsigned char bit) {
 	// Fetch word the bit is in
 	unsigned int wordOffset = (int)(bitPos / 32);
 	unsigned int bitIdx = bitPos - (wordOffset * 32);
+	unsigned int *PWMWaveform = getPWMBuffer();
 
 //	printf("bitPos=%d wordOffset=%d bitIdx=%d value=%d\n", bitPos, wordOffset, bitIdx, bit);
 
@@ -654,6 +1123,7 @@ unsigned char getPWMBit(unsigned int bitPos) {
 	// Fetch word the bit is in
 	unsigned int wordOffset = (int)(bitPos / 32);
 	unsigned int bitIdx = bitPos - (wordOffset * 32);
+	unsigned int *PWMWaveform = getPWMBuffer();
 
 	if(PWMWaveform[wordOffset] & (1 << bitIdx)) {
 		return true;
@@ -662,6 +1132,377 @@ unsigned char getPWMBit(unsigned int bitPos) {
 	}
 }
 
+// Wire bit patterns for every possible color byte. Each color bit turns into three wire bits
+// (1 = 110, 0 = 100), so one byte turns into 24 wire bits, MSB first - the same order setPWMBit()
+// writes them in. Filled in by initWireTable().
+unsigned int wireTable[256];
+
+// The same, but run through each channel's color correction table first. These are what
+// encodePixelsTable() uses, so it does color correction and encoding in one lookup.
+unsigned int redWireTable[256];
+unsigned int greenWireTable[256];
+unsigned int blueWireTable[256];
+
+void initWireTable() {
+	int i, j;
+	for(i=0; i<256; i++) {
+		wireTable[i] = 0;
+		for(j=7; j>=0; j--) {
+			wireTable[i] <<= 3;
+			wireTable[i] |= (i & (1 << j)) ? 0b110 : 0b100;
+		}
+	}
+	buildColorLUT();
+}
+
+// Combine wireTable[] with the color correction tables
+void buildWireTables() {
+	int i;
+	for(i=0; i<256; i++) {
+		redWireTable[i] = wireTable[redLUT[i]];
+		greenWireTable[i] = wireTable[greenLUT[i]];
+		blueWireTable[i] = wireTable[blueLUT[i]];
+	}
+}
+
+// Translate pixels into wire format, a whole byte at a time, writing whole words to dest.
+// Four pixels are 12 color bytes, or 288 wire bits, which is exactly 9 words. So we encode four
+// pixels per pass with no branches, and every group of four starts on a word boundary.
+// Wire order is GRB, not RGB. Bits past the last pixel are written as zeroes. Color correction
+// comes for free, since it's built into the per-channel tables.
+static inline void encodePixelsWith(unsigned int *dest, Color_t *src, unsigned int count,
+		unsigned int *redTable, unsigned int *greenTable, unsigned int *blueTable) {
+	unsigned int p[12];
+	unsigned int words[9];
+	int i;
+
+	while(count >= 4) {
+		p[0]  = greenTable[src[0].g];
+		p[1]  = redTable[src[0].r];
+		p[2]  = blueTable[src[0].b];
+		p[3]  = greenTable[src[1].g];
+		p[4]  = redTable[src[1].r];
+		p[5]  = blueTable[src[1].b];
+		p[6]  = greenTable[src[2].g];
+		p[7]  = redTable[src[2].r];
+		p[8]  = blueTable[src[2].b];
+		p[9]  = greenTable[src[3].g];
+		p[10] = redTable[src[3].r];
+		p[11] = blueTable[src[3].b];
+
+		// Every four 24-bit patterns fill three words
+		dest[0] = (p[0] << 8)  | (p[1] >> 16);
+		dest[1] = (p[1] << 16) | (p[2] >> 8);
+		dest[2] = (p[2] << 24) | p[3];
+		dest[3] = (p[4] << 8)  | (p[5] >> 16);
+		dest[4] = (p[5] << 16) | (p[6] >> 8);
+		dest[5] = (p[6] << 24) | p[7];
+		dest[6] = (p[8] << 8)  | (p[9] >> 16);
+		dest[7] = (p[9] << 16) | (p[10] >> 8);
+		dest[8] = (p[10] << 24) | p[11];
+
+		dest += 9;
+		src += 4;
+		count -= 4;
+	}
+
+	// Last one to three pixels. Missing color bytes are left as all-zero patterns (not the
+	// encoding of a zero byte!), and we only write the words that hold wire bits.
+	if(count > 0) {
+		memset(p, 0, sizeof(p));
+		for(i=0; i<count; i++) {
+			p[i * 3]     = greenTable[src[i].g];
+			p[i * 3 + 1] = redTable[src[i].r];
+			p[i * 3 + 2] = blueTable[src[i].b];
+		}
+		for(i=0; i<3; i++) {
+			words[i * 3]     = (p[i * 4] << 8)      | (p[i * 4 + 1] >> 16);
+			words[i * 3 + 1] = (p[i * 4 + 1] << 16) | (p[i * 4 + 2] >> 8);
+			words[i * 3 + 2] = (p[i * 4 + 2] << 24) | p[i * 4 + 3];
+		}
+		memcpy(dest, words, ((count * 72 + 31) / 32) * 4);
+	}
+}
+
+void encodePixelsTable(unsigned int *dest, Color_t *src, unsigned int count) {
+	encodePixelsWith(dest, src, count, redWireTable, greenWireTable, blueWireTable);
+}
+
+// The same, but with no color correction, for pixels that have had it already (see Dithering)
+void encodePixelsRaw(unsigned int *dest, Color_t *src, unsigned int count) {
+	encodePixelsWith(dest, src, count, wireTable, wireTable, wireTable);
+}
+
+// SIMD encoders
+// --------------------------------------------------------------------------------------------------
+// These do 16 pixels (48 color bytes, 36 words) per pass and leave the last 0-15 pixels to
+// encodePixelsTable(). SIMD units can't do table lookups, so instead of reading wireTable[] they
+// build the same 24-bit patterns with shifts and masks:
+//	1. Put each pixel's bytes in wire (GRB) order
+//	2. Spread the 8 bits of each byte out to every third bit (b7 0 0 b6 0 0 ... b0), shift that
+//	   left by one and OR in 0b100 for every wire bit, giving the pattern for that byte
+//	3. Pack every four patterns into three words, same as encodePixelsTable()
+// Color correction is a lookup, too, so unless the tables are doing nothing, each block of 16
+// pixels goes through applyColorLUT() first. The output is bit-identical to encodePixelsTable().
+#if defined(__SSE2__)
+// 0xFF on every third byte. Loading 16 bytes from an offset of 0, 1 or 2 gives the masks for the
+// byte positions in a given vector that hold (respectively) the G, B or R byte of a pixel, once
+// the pixel is in wire order.
+static const unsigned char swizzleMask[21] = {
+	0xFF, 0, 0, 0xFF, 0, 0, 0xFF, 0, 0, 0xFF, 0, 0, 0xFF, 0, 0, 0xFF, 0, 0, 0xFF, 0, 0
+};
+
+static inline __m128i spreadBitsSSE2(__m128i x) {
+	x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 8)), _mm_set1_epi32(0x00F00F));
+	x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 4)), _mm_set1_epi32(0x0C30C3));
+	x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 2)), _mm_set1_epi32(0x249249));
+	return _mm_or_si128(_mm_slli_epi32(x, 1), _mm_set1_epi32(0x924924));
+}
+
+void encodePixelsSSE2(unsigned int *dest, Color_t *src, unsigned int count) {
+	__m128i byteMask = _mm_set1_epi32(0xFF);
+	__m128i gMask[3], rMask[3], bMask[3];
+	__m128i m[3], s[3];
+	__m128i a, b, c, d, w0, w1, w2;
+	__m128 lo, hi;
+	Color_t corrected[16];
+	Color_t *block;
+	int k;
+
+	// 48 bytes is 3 vectors, and the RGB pattern lines up differently in each of them
+	for(k=0; k<3; k++) {
+		gMask[k] = _mm_loadu_si128((__m128i *)(swizzleMask + k));
+		bMask[k] = _mm_loadu_si128((__m128i *)(swizzleMask + k + 1));
+		rMask[k] = _mm_loadu_si128((__m128i *)(swizzleMask + k + 2));
+	}
+
+	while(count >= 16) {
+		block = src;
+		if(!colorLUTIdentity) {
+			applyColorLUT(corrected, src, 16);
+			block = corrected;
+		}
+		m[0] = _mm_loadu_si128((__m128i *)block);
+		m[1] = _mm_loadu_si128((__m128i *)block + 1);
+		m[2] = _mm_loadu_si128((__m128i *)block + 2);
+
+		// Swap R and G. G moves down a byte and R moves up a byte, crossing vectors where needed.
+		s[0] = _mm_or_si128(_mm_or_si128(
+			_mm_and_si128(m[0], bMask[0]),
+			_mm_and_si128(_mm_or_si128(_mm_srli_si128(m[0], 1), _mm_slli_si128(m[1], 15)), gMask[0])),
+			_mm_and_si128(_mm_slli_si128(m[0], 1), rMask[0]));
+		s[1] = _mm_or_si128(_mm_or_si128(
+			_mm_and_si128(m[1], bMask[1]),
+			_mm_and_si128(_mm_or_si128(_mm_srli_si128(m[1], 1), _mm_slli_si128(m[2], 15)), gMask[1])),
+			_mm_and_si128(_mm_or_si128(_mm_slli_si128(m[1], 1), _mm_srli_si128(m[0], 15)), rMask[1]));
+		s[2] = _mm_or_si128(_mm_or_si128(
+			_mm_and_si128(m[2], bMask[2]),
+			_mm_and_si128(_mm_srli_si128(m[2], 1), gMask[2])),
+			_mm_and_si128(_mm_or_si128(_mm_slli_si128(m[2], 1), _mm_srli_si128(m[1], 15)), rMask[2]));
+
+		for(k=0; k<3; k++) {
+			// Each 32-bit lane holds four wire-order bytes. Make patterns out of them.
+			a = spreadBitsSSE2(_mm_and_si128(s[k], byteMask));
+			b = spreadBitsSSE2(_mm_and_si128(_mm_srli_epi32(s[k], 8), byteMask));
+			c = spreadBitsSSE2(_mm_and_si128(_mm_srli_epi32(s[k], 16), byteMask));
+			d = spreadBitsSSE2(_mm_srli_epi32(s[k], 24));
+
+			// Four patterns make three words
+			w0 = _mm_or_si128(_mm_slli_epi32(a, 8), _mm_srli_epi32(b, 16));
+			w1 = _mm_or_si128(_mm_slli_epi32(b, 16), _mm_srli_epi32(c, 8));
+			w2 = _mm_or_si128(_mm_slli_epi32(c, 24), d);
+
+			// Interleave them so lane 0's three words come first, then lane 1's, and so on
+			lo = _mm_castsi128_ps(_mm_unpacklo_epi32(w0, w1));
+			hi = _mm_castsi128_ps(_mm_unpacklo_epi32(w2, w0));
+			_mm_storeu_si128((__m128i *)dest, _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 0, 1, 0))));
+			lo = _mm_castsi128_ps(_mm_unpacklo_epi32(w1, w2));
+			hi = _mm_castsi128_ps(_mm_unpackhi_epi32(w0, w1));
+			_mm_storeu_si128((__m128i *)dest + 1, _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(1, 0, 3, 2))));
+			lo = _mm_castsi128_ps(_mm_unpackhi_epi32(w2, w0));
+			hi = _mm_castsi128_ps(_mm_unpackhi_epi32(w1, w2));
+			_mm_storeu_si128((__m128i *)dest + 2, _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 2, 3, 0))));
+			dest += 12;
+		}
+
+		src += 16;
+		count -= 16;
+	}
+
+	encodePixelsTable(dest, src, count);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline uint32x4_t spreadBitsNEON(uint32x4_t x) {
+	x = vandq_u32(vorrq_u32(x, vshlq_n_u32(x, 8)), vdupq_n_u32(0x00F00F));
+	x = vandq_u32(vorrq_u32(x, vshlq_n_u32(x, 4)), vdupq_n_u32(0x0C30C3));
+	x = vandq_u32(vorrq_u32(x, vshlq_n_u32(x, 2)), vdupq_n_u32(0x249249));
+	return vorrq_u32(vshlq_n_u32(x, 1), vdupq_n_u32(0x924924));
+}
+
+// Widen four of the 16 bytes in a vector (0-3, 4-7, 8-11 or 12-15) to 32 bits
+static inline uint32x4_t widenQuarterNEON(uint8x16_t v, int quarter) {
+	uint16x8_t half = vmovl_u8(quarter < 2 ? vget_low_u8(v) : vget_high_u8(v));
+	return vmovl_u16(quarter % 2 ? vget_high_u16(half) : vget_low_u16(half));
+}
+
+void encodePixelsNEON(unsigned int *dest, Color_t *src, unsigned int count) {
+	uint32_t patterns[48];		// 16 pixels' worth of patterns, in wire order
+	uint8x16x3_t rgb;
+	uint32x4x3_t grb, words;
+	uint32x4x4_t abcd;
+	Color_t corrected[16];
+	Color_t *block;
+	int k;
+
+	while(count >= 16) {
+		block = src;
+		if(!colorLUTIdentity) {
+			applyColorLUT(corrected, src, 16);
+			block = corrected;
+		}
+
+		// vld3 splits the pixels into R, G and B vectors for us
+		rgb = vld3q_u8((uint8_t *)block);
+
+		// Make patterns four pixels at a time, and let vst3 put them back together in GRB order
+		for(k=0; k<4; k++) {
+			grb.val[0] = spreadBitsNEON(widenQuarterNEON(rgb.val[1], k));
+			grb.val[1] = spreadBitsNEON(widenQuarterNEON(rgb.val[0], k));
+			grb.val[2] = spreadBitsNEON(widenQuarterNEON(rgb.val[2], k));
+			vst3q_u32(patterns + k * 12, grb);
+		}
+
+		// vld4 hands us every fourth pattern in each vector. Four patterns make three words, and
+		// vst3 interleaves those into wire order.
+		for(k=0; k<3; k++) {
+			abcd = vld4q_u32(patterns + k * 16);
+			words.val[0] = vorrq_u32(vshlq_n_u32(abcd.val[0], 8), vshrq_n_u32(abcd.val[1], 16));
+			words.val[1] = vorrq_u32(vshlq_n_u32(abcd.val[1], 16), vshrq_n_u32(abcd.val[2], 8));
+			words.val[2] = vorrq_u32(vshlq_n_u32(abcd.val[2], 24), abcd.val[3]);
+			vst3q_u32((uint32_t *)dest + k * 12, words);
+		}
+
+		dest += 36;
+		src += 16;
+		count -= 16;
+	}
+
+	encodePixelsTable(dest, src, count);
+}
+#endif
+
+// The encoder used by show(). selectEncoder() swaps in the fastest one this CPU can run.
+void (*encodePixels)(unsigned int *dest, Color_t *src, unsigned int count) = encodePixelsTable;
+char *encoderName = "table";
+
+// Time an encoder on a scratch buffer. Returns the best of a few runs, in nanoseconds.
+long timeEncoder(void (*encoder)(unsigned int *, Color_t *, unsigned int)) {
+	static Color_t pixels[256];
+	static unsigned int words[576];
+	struct timespec start, end;
+	long ns, best = -1;
+	int i, run;
+
+	for(i=0; i<256; i++) {
+		pixels[i] = RGB2Color(i, i * 7, i * 13);
+	}
+	for(run=0; run<5; run++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(i=0; i<50; i++) {
+			encoder(words, pixels, 256);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+		if(best < 0 || ns < best) {
+			best = ns;
+		}
+	}
+	return best;
+}
+
+// The encoders this CPU can run (the table one always can). Returns how many it put in list.
+typedef struct {
+	char *name;
+	void (*encode)(unsigned int *dest, Color_t *src, unsigned int count);
+} Encoder_t;
+
+#define MAX_ENCODERS 3
+
+unsigned int listEncoders(Encoder_t *list) {
+	unsigned int n = 0;
+
+	list[n].name = "table";
+	list[n++].encode = encodePixelsTable;
+#if defined(__SSE2__)
+	if(__builtin_cpu_supports("sse2")) {
+		list[n].name = "sse2";
+		list[n++].encode = encodePixelsSSE2;
+	}
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#if defined(__aarch64__)
+	unsigned char neon = true;									// NEON is mandatory on 64-bit ARM...
+#else
+	unsigned char neon = (getauxval(AT_HWCAP) & HWCAP_ARM_NEON) != 0;	// ...but not ARMv6
+#endif
+	if(neon) {
+		list[n].name = "neon";
+		list[n++].encode = encodePixelsNEON;
+	}
+#endif
+	return n;
+}
+
+// All the encoders produce the same output, but which one is fastest depends on the CPU. (On a
+// big out-of-order x86, the lookup table can beat SSE2.) So we time every one this CPU supports.
+void selectEncoder() {
+	Encoder_t encoders[MAX_ENCODERS];
+	unsigned int i, n = listEncoders(encoders);
+	long ns, best = -1;
+
+	for(i = 0; i < n; i++) {
+		ns = timeEncoder(encoders[i].encode);
+		if(best < 0 || ns < best) {
+			best = ns;
+			encodePixels = encoders[i].encode;
+			encoderName = encoders[i].name;
+		}
+	}
+}
+
+// Translate the same stretch of two strips into wire format, for PWM channels 1 and 2. The FIFO
+// hands its words to the channels in turn, so strip 1's words go in the even slots and strip 2's
+// in the odd ones. We encode a block of each strip with the selected encoder, then interleave.
+#define DUAL_BLOCK_PIXELS 64		// 144 words per strip. A multiple of 4, so blocks are whole words.
+
+static void encodeDualWith(void (*encoder)(unsigned int *dest, Color_t *src, unsigned int count),
+		unsigned int *dest, Color_t *src1, Color_t *src2, unsigned int count) {
+	unsigned int words1[DUAL_BLOCK_PIXELS * 9 / 4];
+	unsigned int words2[DUAL_BLOCK_PIXELS * 9 / 4];
+	unsigned int n, words, i;
+
+	while(count > 0) {
+		n = count < DUAL_BLOCK_PIXELS ? count : DUAL_BLOCK_PIXELS;
+		words = (n * 9 + 3) / 4;
+		encoder(words1, src1, n);
+		encoder(words2, src2, n);
+		for(i = 0; i < words; i++) {
+			dest[i * 2] = words1[i];
+			dest[i * 2 + 1] = words2[i];
+		}
+		dest += words * 2;
+		src1 += n;
+		src2 += n;
+		count -= n;
+	}
+}
+
+void encodePixelsDual(unsigned int *dest, Color_t *src1, Color_t *src2, unsigned int count) {
+	encodeDualWith(encodePixels, dest, src1, src2, count);
+}
+
 
 
 // =================================================================================================
@@ -677,7 +1518,7 @@ unsigned char getPWMBit(unsigned int bitPos) {
 void dumpLEDBuffer() {
 	int i;
 	printf("Dumping LED buffer:\n");
-	for(i=0; i<LED_BUFFER_LENGTH; i++) {
+	for(i=0; i<numLEDs; i++) {
 		printf("R:%X G:%X B:%X\n", LEDBuffer[i].r, LEDBuffer[i].g, LEDBuffer[i].b);
 	}
 }
@@ -688,7 +1529,7 @@ void dumpLEDBuffer() {
 void dumpPWMBuffer() {
 	int i;
 	printf("Dumping PWM output buffer:\n");
-	for(i = 0; i < NUM_DATA_WORDS * 32; i++) {
+	for(i = 0; i < transferWords() * 32; i++) {
 		printf("%d", getPWMBit(i));
 		if(i != 0 && i % 72 == 71) {
 			printf("\n");
@@ -852,156 +1693,261 @@ void dumpDMA() {
 //	         \/                  \/      \/           \/              \/            \/ 
 // =================================================================================================
 
-void initHardware() {
-
-	int i = 0;
-	int pid;
-	int fd;
-	char pagemap_fn[64];
-
-	// Clear the PWM buffer
-	// ---------------------------------------------------------------
-	clearPWMBuffer();
-
-	// Set up peripheral access
-	// ---------------------------------------------------------------
-	dma_reg = map_peripheral(DMA_BASE, DMA_LEN);
-	dma_reg += 0x000;
-	pwm_reg = map_peripheral(PWM_BASE, PWM_LEN);
-	clk_reg = map_peripheral(CLK_BASE, CLK_LEN);
-	gpio_reg = map_peripheral(GPIO_BASE, GPIO_LEN);
+// Software-simulated peripherals
+// --------------------------------------------------------------------------------------------------
+// With --simulate, the peripheral registers are ordinary memory (see map_peripheral()), and the
+// pages we allocate for DMA get made-up physical addresses. Those run backwards with a gap between
+// each page, so a broken control block chain shows up right away. When startTransfer() kicks off
+// a transfer, simRunDMA() does the work of the real DMA controller, PWM serializer and LED chain:
+// it walks the control blocks, shifts the words out as wire bits at the rate set by the PWM clock,
+// and decodes those back into pixel colors. That lets us run and profile the driver on any Linux
+// box, and check that the pixels coming out the other end are exactly the ones we meant to send.
+
+#define SIM_PHYS_BASE	0x5F000000		// Where the made-up physical pages start (counting down)
+#define SIM_PLLC_MHZ	1000			// PLLC, which feeds the PWM clock divider
+
+Color_t *simPixels;						// What the chains would be showing (numLEDs pixels)
+unsigned int simPixelCount;				// How many pixels the last transfer set, on all strips
+
+// Statistics, printed by dumpSimulator()
+unsigned long simFrames;				// Transfers run
+unsigned long simWords;					// Words sent
+unsigned long long simWireNs;			// Time the line spent sending those words
+unsigned long long simEncodeNs;			// Time show() spent encoding pixels
+unsigned long long simFirstStartNs;		// When the first transfer started
+unsigned long long simWireEndNs;		// When the last bit of the latest transfer leaves the wire
+unsigned long long simMinIntervalNs;	// Shortest and longest time between transfer starts
+unsigned long long simMaxIntervalNs;
+unsigned long long simLastStartNs;
+unsigned long long simDMADoneNs;		// When the DMA controller will have handed the FIFO its last word
+unsigned long simBadSymbols;			// Wire bit triplets that were neither 110 nor 100
+unsigned long simLateLatches;			// Transfers started before the previous one had latched
+unsigned long simOverflows;				// Pixels sent past the end of a strip
+unsigned long simMismatches;			// Frames that didn't decode to the pixels we meant to send
+
+// Decoder state, for each PWM channel
+static int simPhase[MAX_STRIPS];				// Which bit of a wire bit triplet is next (0-2)
+static unsigned char simMiddleBit[MAX_STRIPS];	// The middle bit of a triplet is the data bit
+static unsigned int simColor[MAX_STRIPS];		// GRB color bits received so far
+static int simColorBits[MAX_STRIPS];
+static unsigned int simStripCount[MAX_STRIPS];	// Pixels received on each strip
+
+// Make up physical addresses for our pages, since there's no real hardware to ask, and make room
+// for the pixels the simulated chain will decode
+void simMapPages() {
+	int i;
+	for(i = 0; i < numPages; i++) {
+		page_map[i].virtaddr = virtbase + i * PAGE_SIZE;
+		page_map[i].physaddr = SIM_PHYS_BASE - i * 2 * PAGE_SIZE;
+	}
+	simPixels = realloc(simPixels, numLEDs * sizeof(Color_t));
+	if(simPixels == 0) {
+		fatal("Failed to malloc simPixels: %m\n");
+	}
+}
 
+// Feed one wire bit to the simulated LED chain on one of the PWM channels
+void simShiftBit(int channel, unsigned char bit) {
+	switch(simPhase[channel]) {
+		case 0:		// Every triplet starts high. If the line is low, we're idle.
+			if(bit) {
+				simPhase[channel] = 1;
+			}
+			break;
+		case 1:
+			simMiddleBit[channel] = bit;
+			simPhase[channel] = 2;
+			break;
+		case 2:		// ...and ends low
+			simPhase[channel] = 0;
+			if(bit) {
+				simBadSymbols++;
+				break;
+			}
+			simColor[channel] = (simColor[channel] << 1) | simMiddleBit[channel];
+			if(++simColorBits[channel] == 24) {
+				if(simStripCount[channel] < stripLength) {
+					simPixels[channel * stripLength + simStripCount[channel]] =
+						RGB2Color(simColor[channel] >> 8, simColor[channel] >> 16, simColor[channel]);
+				} else {
+					simOverflows++;
+				}
+				simStripCount[channel]++;
+				simPixelCount++;
+				simColor[channel] = 0;
+				simColorBits[channel] = 0;
+			}
+			break;
+	}
+}
 
-	// Set PWM alternate function for GPIO18
-	// ---------------------------------------------------------------
-	//gpio_reg[1] &= ~(7 << 24);
-	//usleep(100);
-	//gpio_reg[1] |= (2 << 24);
-	//usleep(100);
-	SET_GPIO_ALT(18, 5);
-	
+// Do what the DMA controller and PWM serializer would do with the transfer startTransfer() just
+// kicked off. This happens all at once, but we work out when the line would be done sending.
+// now is when the transfer started: the same time startTransfer() worked out frameDoneNs from, or
+// a frame sent the moment the last one is done would look like it was early.
+void simRunDMA(unsigned long long now) {
+	uint32_t cbAddr = dma_reg[DMA_CONBLK_AD];
+	uint32_t *words;
+	dma_cb_t *cb;
+	unsigned int i, bit, channel, sent = 0;
+	unsigned long long bitNs = ((clk_reg[engine->clkDiv] >> 12) & 0xFFF) * 1000 / SIM_PLLC_MHZ;
+
+	// The real thing would just sit there (or send garbage) if any of this was wrong
+	if(!(dma_reg[DMA_CS] & (1 << DMA_CS_ACTIVE))) {
+		fatal("Simulator: DMA started without setting ACTIVE\n");
+	}
+	if(engine == &outputEngines[ENGINE_PCM]) {
+		if((pcm_reg[PCM_CS] & ((1 << PCM_CS_EN) | (1 << PCM_CS_TXON) | (1 << PCM_CS_DMAEN))) !=
+			((1 << PCM_CS_EN) | (1 << PCM_CS_TXON) | (1 << PCM_CS_DMAEN)) ||
+			((pcm_reg[PCM_MODE] >> PCM_MODE_FLEN) & 0x3FF) != 31 ||
+			pcm_reg[PCM_TXC] != ((1 << PCM_TXC_CH1WEX) | (1 << PCM_TXC_CH1EN) | (8 << PCM_TXC_CH1WID))) {
+			fatal("Simulator: PCM isn't set up to send words from DMA back to back\n");
+		}
+		if(((gpio_reg[2] >> 3) & 7) != 4) {
+			fatal("Simulator: GPIO21 isn't set to PCM_DOUT (ALT0)\n");
+		}
+	} else if((pwm_reg[PWM_CTL] & ((1 << PWM_CTL_PWEN1) | (1 << PWM_CTL_MODE1) | (1 << PWM_CTL_USEF1))) !=
+		((1 << PWM_CTL_PWEN1) | (1 << PWM_CTL_MODE1) | (1 << PWM_CTL_USEF1)) ||
+		pwm_reg[PWM_RNG1] != 32 || !(pwm_reg[PWM_DMAC] & (1 << PWM_DMAC_ENAB))) {
+		fatal("Simulator: PWM isn't set up to serialize words from DMA\n");
+	}
+	if(numStrips == 2 &&
+		((pwm_reg[PWM_CTL] & ((1 << PWM_CTL_PWEN2) | (1 << PWM_CTL_MODE2) | (1 << PWM_CTL_USEF2))) !=
+		((1 << PWM_CTL_PWEN2) | (1 << PWM_CTL_MODE2) | (1 << PWM_CTL_USEF2)) || pwm_reg[PWM_RNG2] != 32)) {
+		fatal("Simulator: PWM channel 2 isn't set up to serialize words from DMA\n");
+	}
+	if(engine == &outputEngines[ENGINE_PWM] &&
+		(((gpio_reg[1] >> 24) & 7) != 2 || (numStrips == 2 && ((gpio_reg[1] >> 27) & 7) != 2))) {
+		fatal("Simulator: GPIO18/19 aren't set to PWM (ALT5)\n");
+	}
 
-	// Allocate memory for the DMA control block & data to be sent
-	// ---------------------------------------------------------------
-	virtbase = mmap(
-		NULL,													// Address
-		NUM_PAGES * PAGE_SIZE,									// Length
-		PROT_READ | PROT_WRITE,									// Protection
-		MAP_SHARED |											// Shared
-		MAP_ANONYMOUS |											// Not file-based, init contents to 0
-		MAP_NORESERVE |											// Don't reserve swap space
-		MAP_LOCKED,												// Lock in RAM (don't swap)
-		-1,														// File descriptor
-		0);														// Offset
-
-	if (virtbase == MAP_FAILED) {
-		fatal("Failed to mmap physical pages: %m\n");
+	// Did the previous frame have time to latch?
+	if(simFrames > 0) {
+		if(now < simWireEndNs + engine->latchNs) {
+			simLateLatches++;
+		}
+		if(simFrames == 1 || now - simLastStartNs < simMinIntervalNs) {
+			simMinIntervalNs = now - simLastStartNs;
+		}
+		if(now - simLastStartNs > simMaxIntervalNs) {
+			simMaxIntervalNs = now - simLastStartNs;
+		}
+	} else {
+		simFirstStartNs = now;
 	}
-
-	if ((unsigned long)virtbase & (PAGE_SIZE-1)) {
-		fatal("Virtual address is not page aligned\n");
+	simLastStartNs = now;
+
+	// Walk the control block chain
+	simPixelCount = 0;
+	memset(simStripCount, 0, sizeof(simStripCount));
+	while(cbAddr) {
+		cb = mem_phys_to_virt(cbAddr);
+		if(cb->dst != engine->fifo || ((cb->info >> DMA_TI_PERMAP) & 0b11111) != engine->dreq) {
+			fatal("Simulator: control block at 0x%08x doesn't feed the %s FIFO\n", cbAddr, engine->name);
+		}
+		if(cb->length % 4) {
+			fatal("Simulator: control block at 0x%08x sends part of a word\n", cbAddr);
+		}
+		for(i = 0; i < cb->length / 4; i++) {
+			// Look up every page by its physical address, like the real thing. If a CB runs off the
+			// end of a page, we wind up somewhere else entirely (or nowhere, which is fatal).
+			if(i == 0 || ((cb->src + i * 4) & (PAGE_SIZE - 1)) == 0) {
+				words = mem_phys_to_virt(cb->src + i * 4);
+			}
+			// With two channels in use, the FIFO hands them words in turn
+			channel = (sent + i) % numStrips;
+			for(bit = 32; bit > 0; bit--) {
+				simShiftBit(channel, (*words >> (bit - 1)) & 1);
+			}
+			words++;
+		}
+		sent += cb->length / 4;
+		cbAddr = cb->next;
 	}
 
-	//printf("virtbase mapped 0x%x bytes at 0x%x\n", NUM_PAGES * PAGE_SIZE, virtbase);
-
-	// Allocate page map (pointers to the control block(s) and data for each CB
-	page_map = malloc(NUM_PAGES * sizeof(*page_map));
-	if (page_map == 0) {
-		fatal("Failed to malloc page_map: %m\n");
-	} else {
-		//printf("Allocated 0x%x bytes for page_map at 0x%x\n", NUM_PAGES * sizeof(*page_map), page_map);
+	// A pixel cut off partway is as good as a bad symbol
+	for(channel = 0; channel < numStrips; channel++) {
+		if(simPhase[channel] != 0 || simColorBits[channel] != 0) {
+			simBadSymbols++;
+		}
+		simPhase[channel] = 0;
+		simColor[channel] = 0;
+		simColorBits[channel] = 0;
 	}
 
-	// Use /proc/self/pagemap to figure out the mapping between virtual and physical addresses
-	pid = getpid();
-	sprintf(pagemap_fn, "/proc/%d/pagemap", pid);
-	fd = open(pagemap_fn, O_RDONLY);
+	// The channels send side by side, so the wire is busy for each one's share of the words
+	simFrames++;
+	simWords += sent;
+	simWireNs += sent / numStrips * 32 * bitNs;
+	simWireEndNs = now + sent / numStrips * 32 * bitNs;
 
-	if (fd < 0) {
-		fatal("Failed to open %s: %m\n", pagemap_fn);
-	}
+	// The DMA controller is done once the FIFO (16 words for PWM, 64 for PCM) has taken the last
+	// word. simPoll() clears ACTIVE and sets END when that time comes.
+	simDMADoneNs = sent > engine->fifoWords ? now + (sent - engine->fifoWords) / numStrips * 32 * bitNs : now;
+}
 
-	if (lseek(fd, (unsigned long)virtbase >> 9, SEEK_SET) != (unsigned long)virtbase >> 9) {
-		fatal("Failed to seek on %s: %m\n", pagemap_fn);
+// Update the DMA registers to match how far along the simulated transfer is
+void simPoll() {
+	if((dma_reg[DMA_CS] & (1 << DMA_CS_ACTIVE)) && nowNs() >= simDMADoneNs) {
+		dma_reg[DMA_CONBLK_AD] = 0;
+		dma_reg[DMA_CS] = (dma_reg[DMA_CS] & ~(1 << DMA_CS_ACTIVE)) | (1 << DMA_CS_END);
 	}
+}
 
-	//printf("Page map: %d pages\n", NUM_PAGES);
-	for (i = 0; i < NUM_PAGES; i++) {
-		uint64_t pfn;
-		page_map[i].virtaddr = virtbase + i * PAGE_SIZE;
-
-		// Following line forces page to be allocated
-		// (Note: Copied directly from Hirst's code... page_map[i].virtaddr[0] was just set...?)
-		page_map[i].virtaddr[0] = 0;
-
-		if (read(fd, &pfn, sizeof(pfn)) != sizeof(pfn)) {
-			fatal("Failed to read %s: %m\n", pagemap_fn);
+// Check that the last transfer decoded to exactly these pixels, once they've been color corrected
+static void simComparePixels(Color_t *expected, unsigned int count, unsigned char correct) {
+	Color_t corrected;
+	int i;
+	if(simPixelCount != count) {
+		simMismatches++;
+		return;
+	}
+	for(i=0; i<count; i++) {
+		corrected = expected[i];
+		if(correct) {
+			applyColorLUT(&corrected, &expected[i], 1);
 		}
-
-		if ((pfn >> 55)&0xfbf != 0x10c) {  // pagemap bits: https://www.kernel.org/doc/Documentation/vm/pagemap.txt
-			fatal("Page %d not present (pfn 0x%016llx)\n", i, pfn);
+		if(memcmp(&simPixels[i], &corrected, sizeof(Color_t)) != 0) {
+			simMismatches++;
+			return;
 		}
-
-		page_map[i].physaddr = (unsigned int)pfn << PAGE_SHIFT | 0x40000000;
-		//printf("Page map #%2d: virtual %8p ==> physical 0x%08x [0x%016llx]\n", i, page_map[i].virtaddr, page_map[i].physaddr, pfn);
-	}
-
-
-	// Set up control block
-	// ---------------------------------------------------------------
-	ctl = (struct control_data_s *)virtbase;
-	dma_cb_t *cbp = ctl->cb;
-	// FIXME: Change this to use DEFINEs
-	unsigned int phys_pwm_fifo_addr = 0x7e20c000 + 0x18;
-
-	// No wide bursts, source increment, dest DREQ on line 5, wait for response, enable interrupt
-	cbp->info = DMA_TI_CONFIGWORD;
-
-	// Source is our allocated memory
-	cbp->src = mem_virt_to_phys(ctl->sample);
-	
-	// Destination is the PWM controller
-	cbp->dst = phys_pwm_fifo_addr;
-
-	// 72 bits per pixel / 32 bits per word = 2.25 words per pixel
-	// Add 1 to make sure the PWM FIFO gets the message: "we're sending zeroes"
-	// Times 4 because DMA works in bytes, not words
-	cbp->length = ((numLEDs * 2.25) + 1) * 4;
-	if(cbp->length > NUM_DATA_WORDS * 4) {
-		cbp->length = NUM_DATA_WORDS * 4;
 	}
+}
 
-	// We don't use striding
-	cbp->stride = 0;
-	
-	// These are reserved
-	cbp->pad[0] = 0;
-	cbp->pad[1] = 0;
-	
-	// Pointer to next block - 0 shuts down the DMA channel when transfer is complete
-	cbp->next = 0;
-
-	// Testing
-	/*
-	ctl = (struct control_data_s *)virtbase;
-	ctl->sample[0] = 0x00000000;
-	ctl->sample[1] = 0x000000FA;
-	ctl->sample[2] = 0x0000FFFF;
-	ctl->sample[3] = 0xAAAAAAAA;
-	ctl->sample[4] = 0xF0F0F0F0;
-	ctl->sample[5] = 0x0A0A0A0A;
-	ctl->sample[6] = 0xF00F0000;
-	*/
+void simCheckFrame(Color_t *expected, unsigned int count) {
+	simComparePixels(expected, count, true);
+}
 
+// The same, for pixels that have been through color correction already (dithered ones)
+void simCheckWire(Color_t *expected, unsigned int count) {
+	simComparePixels(expected, count, false);
+}
 
-	// Stop any existing DMA transfers
-	// ---------------------------------------------------------------
-	dma_reg[DMA_CS] |= (1 << DMA_CS_ABORT);
-	usleep(100);
-	dma_reg[DMA_CS] = (1 << DMA_CS_RESET);
-	usleep(100);
+// Print the simulator's statistics
+void dumpSimulator() {
+	unsigned long long elapsedNs = simWireEndNs - simFirstStartNs;
+
+	printf("Simulator\n");
+	printf("	        Frames: %lu\n", simFrames);
+	printf("	  Pixels/frame: %u\n", simPixelCount);
+	printf("	   Words/frame: %lu\n", simFrames ? simWords / simFrames : 0);
+	printf("	   Encode time: %.2f ns/pixel\n", simFrames && simPixelCount ? (double)simEncodeNs / simFrames / simPixelCount : 0);
+	printf("	     Wire time: %.3f ms/frame\n", simFrames ? simWireNs / 1e6 / simFrames : 0);
+	printf("	  Frame period: %.3f ms min, %.3f ms avg, %.3f ms max\n",
+		simMinIntervalNs / 1e6, simFrames > 1 ? (simLastStartNs - simFirstStartNs) / 1e6 / (simFrames - 1) : 0,
+		simMaxIntervalNs / 1e6);
+	printf("	    Frame rate: %.1f fps (wire busy %.1f%% of the time)\n",
+		elapsedNs ? simFrames * 1e9 / elapsedNs : 0, elapsedNs ? simWireNs * 100.0 / elapsedNs : 0);
+	printf("	   Bad symbols: %lu\n", simBadSymbols);
+	printf("	  Late latches: %lu\n", simLateLatches);
+	printf("	     Overflows: %lu\n", simOverflows);
+	printf("	    Mismatches: %lu\n", simMismatches);
+	printf("\n");
+}
 
 
+// Set up the PWM clock and both PWM channels to serialize words from DMA
+static void initPWM() {
 	// PWM Clock
 	// ---------------------------------------------------------------
 	// Kill the clock
@@ -1016,7 +1962,7 @@ void initHardware() {
 	// The fractional part is quantized to a range of 0-1024, so multiply the decimal part by 1024.
 	// E.g., 0.25 * 1024 = 256.
 	// So, if you want a divisor of 400.5, set idiv to 400 and fdiv to 512.
-	unsigned int idiv = 400;
+	unsigned int idiv = PWM_CLK_IDIV;
 	unsigned short fdiv = 0;	// Should be 16 bits, but the value must be <= 1024
 	clk_reg[PWM_CLK_DIV] = 0x5A000000 | (idiv << 12) | fdiv;	// Set clock multiplier
 	usleep(100);
@@ -1072,341 +2018,3441 @@ void initHardware() {
 	// Disable MSEN1
 	CLRBIT(pwm_reg[PWM_CTL], PWM_CTL_MSEN1);
 	usleep(100);
-	
 
-	// DMA
+	// Channel 2 gets the same treatment, if it's driving a second strip. The channels take turns
+	// reading words from the FIFO.
+	if(numStrips == 2) {
+		pwm_reg[PWM_RNG2] = 32;
+		usleep(100);
+		CLRBIT(pwm_reg[PWM_CTL], PWM_CTL_RPTL2);
+		CLRBIT(pwm_reg[PWM_CTL], PWM_CTL_SBIT2);
+		CLRBIT(pwm_reg[PWM_CTL], PWM_CTL_POLA2);
+		SETBIT(pwm_reg[PWM_CTL], PWM_CTL_MODE2);
+		SETBIT(pwm_reg[PWM_CTL], PWM_CTL_USEF2);
+		CLRBIT(pwm_reg[PWM_CTL], PWM_CTL_MSEN2);
+		usleep(100);
+	}
+}
+
+// Set up the PCM clock and controller to serialize words from DMA, the same way the PWM does
+static void initPCM() {
+	// PCM Clock
 	// ---------------------------------------------------------------
-	// Raise an interrupt when transfer is complete, which will set the INT flag in the CS register
-	SETBIT(dma_reg[DMA_CS], DMA_CS_INT);
-	usleep(100);
-	
-	// Clear the END flag (by setting it - this is a "write 1 to clear", or W1C, bit)
-	SETBIT(dma_reg[DMA_CS], DMA_CS_END);
+	// Kill the clock, then set it up just like the PWM clock: PLLC / PWM_CLK_IDIV, for one wire
+	// bit per PCM clock
+	clk_reg[PCM_CLK_CNTL] = 0x5A000000 | (1 << 5);
 	usleep(100);
-	
-	// Send the physical address of the control block into the DMA controller
-	dma_reg[DMA_CONBLK_AD] = mem_virt_to_phys(ctl->cb);
+	clk_reg[PCM_CLK_DIV] = 0x5A000000 | (PWM_CLK_IDIV << 12);
 	usleep(100);
-	
-	// Clear error flags, if any (these are also W1C bits)
-	// FIXME: Use a define instead of this
-	dma_reg[DMA_DEBUG] = 7;
+	clk_reg[PCM_CLK_CNTL] = 0x5A000015;
 	usleep(100);
-}
 
-// Begin the transfer
-void startTransfer() {
-	// Enable DMA
-	dma_reg[DMA_CONBLK_AD] = mem_virt_to_phys(ctl->cb);
-	dma_reg[DMA_CS] = DMA_CS_CONFIGWORD | (1 << DMA_CS_ACTIVE);
-	usleep(100);
 
-	// Enable PWM
-	SETBIT(pwm_reg[PWM_CTL], PWM_CTL_PWEN1);
+	// PCM
+	// ---------------------------------------------------------------
+	// Clear any preexisting crap, then enable the block and wake up its FIFO RAMs
+	pcm_reg[PCM_CS] = 0;
+	usleep(100);
+	pcm_reg[PCM_CS] = (1 << PCM_CS_EN) | (1 << PCM_CS_STBY);
+	usleep(100);
 
-//	dumpPWM();
-//	dumpDMA();
-}
+	// 32-clock frames, and the frame sync pin (which we don't use) high for one clock of each
+	pcm_reg[PCM_MODE] = (31 << PCM_MODE_FLEN) | (1 << PCM_MODE_FSLEN);
 
+	// One 32-bit channel (8 + 16 + 8), starting at the first clock of the frame. So every frame is
+	// exactly one word from the FIFO, with no gaps between them.
+	pcm_reg[PCM_TXC] = (1 << PCM_TXC_CH1WEX) | (1 << PCM_TXC_CH1EN) | (0 << PCM_TXC_CH1POS) | (8 << PCM_TXC_CH1WID);
+	pcm_reg[PCM_RXC] = 0;
 
+	// Send DMA requests to keep the (64-word) FIFO topped up
+	pcm_reg[PCM_DREQ] = (0x30 << PCM_DREQ_TX) | (0x10 << PCM_DREQ_TX_PANIC);
+	usleep(100);
 
-// =================================================================================================
-//	  ____ ___            .___       __           .____     ___________________          
-//	 |    |   \______   __| _/____ _/  |_  ____   |    |    \_   _____/\______ \   ______
-//	 |    |   /\____ \ / __ |\__  \\   __\/ __ \  |    |     |    __)_  |    |  \ /  ___/
-//	 |    |  / |  |_> > /_/ | / __ \|  | \  ___/  |    |___  |        \ |    `   \\___ \ 
-//	 |______/  |   __/\____ |(____  /__|  \___  > |_______ \/_______  //_______  /____  >
-//	           |__|        \/     \/          \/          \/        \/         \/     \/ 
-// =================================================================================================
+	// Clear the FIFO. It takes a couple of PCM clocks to happen.
+	SETBIT(pcm_reg[PCM_CS], PCM_CS_TXCLR);
+	usleep(100);
 
-void show() {
+	// Clear the underrun flag (W1C), and start sending DMA requests
+	SETBIT(pcm_reg[PCM_CS], PCM_CS_TXERR);
+	SETBIT(pcm_reg[PCM_CS], PCM_CS_DMAEN);
+	usleep(100);
+}
 
-	// Clear out the PWM buffer
-	// Disabled, because we will overwrite the buffer anyway.
+// Set up for strips strips (1 or 2) of leds LEDs each
+void initHardware(unsigned int leds, unsigned int strips) {
 
-	// Read data from LEDBuffer[], translate it into wire format, and write to PWMWaveform
-	int i, j;
-	unsigned int LEDBuffeWordPos = 0;
-	unsigned int PWMWaveformBitPos = 0;
-	unsigned int colorBits = 0;			// Holds the GRB color before conversion to wire bit pattern
-	unsigned char colorBit = 0;			// Holds current bit out of colorBits to be processed
-	unsigned int wireBit = 0;			// Holds the current bit we will set in PWMWaveform
-	Color_t color;
+	int i = 0;
+	int pid;
+	int fd;
+	char pagemap_fn[64];
+	unsigned int cbPages, pixelPages;
 
-	for(i=0; i<numLEDs; i++) {
-		// Create bits necessary to represent one color triplet (in GRB, not RGB, order)
-		//printf("RGB: %d, %d, %d\n", LEDBuffer[i].r, LEDBuffer[i].g, LEDBuffer[i].b);
-		LEDBuffer[i].r *= brightness;
-		LEDBuffer[i].g *= brightness;
-		LEDBuffer[i].b *= brightness;
-		colorBits = ((unsigned int)LEDBuffer[i].r << 8) | ((unsigned int)LEDBuffer[i].g << 16) | LEDBuffer[i].b;
-		//printBinary(colorBits, 24);
-		//printf(" (binary, GRB order)\n");
-
-		// Iterate through color bits to get wire bits
-		for(j=23; j>=0; j--) {
-			colorBit = (colorBits & (1 << j)) ? 1 : 0;
-			switch(colorBit) {
-				case 1:
-					//wireBits = 0b110;	// High, High, Low
-					setPWMBit(wireBit++, 1);
-					setPWMBit(wireBit++, 1);
-					setPWMBit(wireBit++, 0);
-					break;
-				case 0:
-					//wireBits = 0b100;	// High, Low, Low
-					setPWMBit(wireBit++, 1);
-					setPWMBit(wireBit++, 0);
-					setPWMBit(wireBit++, 0);
-					break;
-			}
-		}
+	if(leds == 0) {
+		fatal("Can't drive a strip of 0 LEDs\n");
+	}
+	if(strips < 1 || strips > MAX_STRIPS) {
+		fatal("Can't drive %d strips (1 or 2, please)\n", strips);
+	}
+	if(strips > 1 && engine != &outputEngines[ENGINE_PWM]) {
+		fatal("Only the PWM engine can drive two strips\n");
+	}
+	numStrips = strips;
+	stripLength = leds;
+	numLEDs = leds * strips;
+	if(dmaChannel < 0) {
+		dmaChannel = engine->dmaChannel;
+	}
+	if(dmaChannel > 14) {
+		fatal("DMA channel %d doesn't exist (0-14, please)\n", dmaChannel);
 	}
 
-	// Copy PWM waveform to DMA's data buffer
-	//printf("Copying %d words to DMA data buffer\n", NUM_DATA_WORDS);
-	ctl = (struct control_data_s *)virtbase;
-	dma_cb_t *cbp = ctl->cb;
+	// Set up the pixel encoder
+	// ---------------------------------------------------------------
+	initWireTable();
+	selectEncoder();
 
-	// This block is a major CPU hog when there are lots of pixels to be transmitted.
-	// It would go quicker with DMA.
-	for(i = 0; i < (cbp->length / 4); i++) {
-		ctl->sample[i] = PWMWaveform[i];
+	// Set up peripheral access. We only touch the peripheral we're sending with.
+	// ---------------------------------------------------------------
+	dma_reg = map_peripheral(DMA_BASE, dmaChannel * DMA_CHANNEL_LEN + DMA_LEN);
+	dma_reg += dmaChannel * DMA_CHANNEL_LEN / 4;
+	if(engine == &outputEngines[ENGINE_PCM]) {
+		pcm_reg = map_peripheral(PCM_BASE, PCM_LEN);
+	} else {
+		pwm_reg = map_peripheral(PWM_BASE, PWM_LEN);
 	}
+	clk_reg = map_peripheral(CLK_BASE, CLK_LEN);
+	gpio_reg = map_peripheral(GPIO_BASE, GPIO_LEN);
 
 
-	// Enable DMA and PWM engines, which should now send the data
-	startTransfer();
+	// Set the alternate function for the output pin(s)
+	// ---------------------------------------------------------------
+	if(engine == &outputEngines[ENGINE_PCM]) {
+		// PCM_DOUT on GPIO21
+		INP_GPIO(21);
+		SET_GPIO_ALT(21, 0);
+	} else {
+		// PWM channel 1 on GPIO18
+		//gpio_reg[1] &= ~(7 << 24);
+		//usleep(100);
+		//gpio_reg[1] |= (2 << 24);
+		//usleep(100);
+		SET_GPIO_ALT(18, 5);
+
+		// ...and channel 2 on GPIO19, for the second strip
+		if(numStrips == 2) {
+			INP_GPIO(19);
+			SET_GPIO_ALT(19, 5);
+		}
+	}
 
-	// Wait long enough for the DMA transfer to finish
-	// 3 RAM bits per wire bit, so 72 bits to send one color command.
-	float bitTimeUSec = (float)(NUM_DATA_WORDS * 32) * 0.4;	// Bits sent * time to transmit one bit, which is 0.4μSec
-	//printf("Delay for %d μSec\n", (int)bitTimeUSec);
-	usleep((int)bitTimeUSec);
-/*
 
-This is the old FIFO-filling code.
-The FIFO only has enough words for about 7 LEDs, which is why we use DMA instead!
+	// Allocate memory for the DMA control blocks, the data to be sent, and the pixels
+	// ---------------------------------------------------------------
+	numSamplePages = (transferWords() * 4 + PAGE_SIZE - 1) / PAGE_SIZE;
+	cbPages = (NUM_BUFFERS * numSamplePages * sizeof(dma_cb_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+	pixelPages = (numLEDs * sizeof(Color_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+	numPages = cbPages + NUM_BUFFERS * numSamplePages + pixelPages;
 
-	for(i=0; i<NUM_DATA_WORDS; i++) {
-		
-		// That done, we add the word to the FIFO
-		printf("Adding word to FIFO: ");
-		printBinary(PWMWaveform[i], 32);
-		printf("\n");
-		pwm_reg[PWM_FIF1] = PWMWaveform[i];
-//		*(pwm + PWM_FIF1) = 0xACAC00F0;	// A test pattern easily visible on an oscilloscope, but not WS2812 compatible
-		usleep(20);
-	}
-/**/
+	virtbase = mmap(
+		NULL,													// Address
+		numPages * PAGE_SIZE,									// Length
+		PROT_READ | PROT_WRITE,									// Protection
+		MAP_SHARED |											// Shared
+		MAP_ANONYMOUS |											// Not file-based, init contents to 0
+		MAP_NORESERVE |											// Don't reserve swap space
+		(simulate ? 0 : MAP_LOCKED),							// Lock in RAM (don't swap)
+		-1,														// File descriptor
+		0);														// Offset
 
-}
+	if (virtbase == MAP_FAILED) {
+		fatal("Failed to mmap physical pages: %m\n");
+	}
 
+	if ((unsigned long)virtbase & (PAGE_SIZE-1)) {
+		fatal("Virtual address is not page aligned\n");
+	}
 
+	//printf("virtbase mapped 0x%x bytes at 0x%x\n", numPages * PAGE_SIZE, virtbase);
 
-// =================================================================================================
-//	___________ _____  _____              __          
-//	\_   _____// ____\/ ____\____   _____/  |_  ______
-//	 |    __)_\   __\\   __\/ __ \_/ ___\   __\/  ___/
-//	 |        \|  |   |  | \  ___/\  \___|  |  \___ \ 
-//	/_______  /|__|   |__|  \___  >\___  >__| /____  >
-//	        \/                  \/     \/          \/ 
-// =================================================================================================
-// The effects in this section are adapted from the Adafruit NeoPixel library at:
-// https://github.com/adafruit/Adafruit_NeoPixel/blob/master/examples/strandtest/strandtest.ino
+	// Carve it up. CBs never straddle a page, since 128 of them fit in one exactly.
+	ctl->cb[0] = (dma_cb_t *)virtbase;
+	for(i = 1; i < NUM_BUFFERS; i++) {
+		ctl->cb[i] = ctl->cb[i - 1] + numSamplePages;
+	}
+	for(i = 0; i < NUM_BUFFERS; i++) {
+		ctl->sample[i] = (uint32_t *)(virtbase + (cbPages + i * numSamplePages) * PAGE_SIZE);
+	}
+	LEDBuffer = (Color_t *)(virtbase + (cbPages + NUM_BUFFERS * numSamplePages) * PAGE_SIZE);
 
-// Input a value 0 to 255 to get a color value.
-// The colours are a transition r - g - b - back to r.
-Color_t Wheel(uint8_t WheelPos) {
-	if(WheelPos < 85) {
-		return Color(WheelPos * 3, 255 - WheelPos * 3, 0);
-	} else if(WheelPos < 170) {
-		WheelPos -= 85;
-		return Color(255 - WheelPos * 3, 0, WheelPos * 3);
+	// Allocate page map (pointers to the control block(s) and data for each CB
+	page_map = malloc(numPages * sizeof(*page_map));
+	if (page_map == 0) {
+		fatal("Failed to malloc page_map: %m\n");
 	} else {
-		WheelPos -= 170;
-		return Color(0, WheelPos * 3, 255 - WheelPos * 3);
+		//printf("Allocated 0x%x bytes for page_map at 0x%x\n", numPages * sizeof(*page_map), page_map);
 	}
-}
-
 
-// Fill the dots one after the other with a color
-void colorWipe(Color_t c, uint8_t wait) {
-	uint16_t i;
-	for(i=0; i<numPixels(); i++) {
-		setPixelColorT(i, c);
-		show();
-		usleep(wait * 1000);
-	}
-}
+	// Use /proc/self/pagemap to figure out the mapping between virtual and physical addresses
+	// (The simulator makes up its own.)
+	if(simulate) {
+		simMapPages();
+	} else {
+		pid = getpid();
+		sprintf(pagemap_fn, "/proc/%d/pagemap", pid);
+		fd = open(pagemap_fn, O_RDONLY);
 
-// Rainbow
-void rainbow(uint8_t wait) {
-	uint16_t i, j;
+		if (fd < 0) {
+			fatal("Failed to open %s: %m\n", pagemap_fn);
+		}
 
-	for(j=0; j<256; j++) {
-		for(i=0; i<numPixels(); i++) {
-			setPixelColorT(i, Wheel((i+j) & 255));
+		if (lseek(fd, (unsigned long)virtbase >> 9, SEEK_SET) != (unsigned long)virtbase >> 9) {
+			fatal("Failed to seek on %s: %m\n", pagemap_fn);
 		}
-		show();
-		usleep(wait * 1000);
-	}
-}
 
-// Slightly different, this makes the rainbow equally distributed throughout
-void rainbowCycle(uint8_t wait) {
-	uint16_t i, j;
+		//printf("Page map: %d pages\n", numPages);
+		for (i = 0; i < numPages; i++) {
+			uint64_t pfn;
+			page_map[i].virtaddr = virtbase + i * PAGE_SIZE;
 
-	for(j=0; j<256*5; j++) { // 5 cycles of all colors on wheel
-		for(i=0; i<numPixels(); i++) {
-			setPixelColorT(i, Wheel(((i * 256 / numPixels()) + j) & 255));
-		}
-		show();
-		usleep(wait * 1000);
-	}
-}
+			// Following line forces page to be allocated
+			// (Note: Copied directly from Hirst's code... page_map[i].virtaddr[0] was just set...?)
+			page_map[i].virtaddr[0] = 0;
 
-//Theatre-style crawling lights.
-void theaterChase(Color_t c, uint8_t wait) {
-	unsigned int j, q, i;
-	for (j=0; j<15; j++) {  //do this many cycles of chasing
-		for (q=0; q < 3; q++) {
-			for (i=0; i < numPixels(); i=i+3) {
-				setPixelColorT(i+q, c);			// Turn every third pixel on
+			if (read(fd, &pfn, sizeof(pfn)) != sizeof(pfn)) {
+				fatal("Failed to read %s: %m\n", pagemap_fn);
 			}
-			show();
-     
-			usleep(wait * 1000);
 
-			for (i=0; i < numPixels(); i=i+3) {
-				setPixelColor(i+q, 0, 0, 0);	// Turn every third pixel off
+			if ((pfn >> 55)&0xfbf != 0x10c) {  // pagemap bits: https://www.kernel.org/doc/Documentation/vm/pagemap.txt
+				fatal("Page %d not present (pfn 0x%016llx)\n", i, pfn);
 			}
+
+			page_map[i].physaddr = (unsigned int)pfn << PAGE_SHIFT | 0x40000000;
+			//printf("Page map #%2d: virtual %8p ==> physical 0x%08x [0x%016llx]\n", i, page_map[i].virtaddr, page_map[i].physaddr, pfn);
 		}
 	}
-}
 
-//Theatre-style crawling lights with rainbow effect
-void theaterChaseRainbow(uint8_t wait) {
-	int j, q, i;
-	for (j=0; j < 256; j+=4) {     // cycle through every 4th color on the wheel
-		for (q=0; q < 3; q++) {
-			for (i=0; i < numPixels(); i=i+3) {
-				setPixelColorT(i+q, Wheel((i+j) % 255));    //turn every third pixel on
-			}
-			show();
 
-			usleep(wait * 1000);
-       
-			for (i=0; i < numPixels(); i=i+3) {
-				setPixelColor(i+q, 0, 0, 0);        //turn every third pixel off
-			}
-		}
-	}
-}
+	// Clear the PWM buffers, and set up control blocks, one per page of samples, for each of them
+	// ---------------------------------------------------------------
+	clearPWMBuffer();
+	dma_cb_t *cbp;
+	unsigned int bytesLeft;
+	int buffer;
 
+	for(buffer = 0; buffer < NUM_BUFFERS; buffer++) {
+		// Times 4 because DMA works in bytes, not words
+		bytesLeft = transferWords() * 4;
 
+		for(i = 0; i < numSamplePages; i++) {
+			cbp = &ctl->cb[buffer][i];
 
-// =================================================================================================
-//	   _____         .__        
-//	  /     \ _____  |__| ____  
-//	 /  \ /  \\__  \ |  |/    \ 
-//	/    Y    \/ __ \|  |   |  \
-//	\____|__  (____  /__|___|  /
-//	        \/     \/        \/ 
-// =================================================================================================
+			// No wide bursts, source increment, dest DREQ on the engine's line, wait for response,
+			// enable interrupt
+			cbp->info = DMA_TI_CONFIGWORD | (engine->dreq << DMA_TI_PERMAP);
 
-void effectsDemo() {
+			// Source is this CB's page of our allocated memory
+			cbp->src = mem_virt_to_phys((uint8_t *)ctl->sample[buffer] + i * PAGE_SIZE);
 
-	int i, j, ptr;
-	float k;
+			// Destination is the PWM (or PCM) controller's FIFO
+			cbp->dst = engine->fifo;
 
-	// Default effects from the Arduino lib
-	colorWipe(Color(255, 0, 0), 50); // Red
-	colorWipe(Color(0, 255, 0), 50); // Green
-	colorWipe(Color(0, 0, 255), 50); // Blue
-	theaterChase(Color(127, 127, 127), 50); // White
-	theaterChase(Color(127,   0,   0), 50); // Red
-	theaterChase(Color(  0,   0, 127), 50); // Blue
-	rainbow(5);
-	rainbowCycle(5);
-	theaterChaseRainbow(50);
+			// Up to one page per CB
+			cbp->length = bytesLeft > PAGE_SIZE ? PAGE_SIZE : bytesLeft;
+			bytesLeft -= cbp->length;
 
-	// Watermelon fade :)
-	for(k=0; k<0.5; k+=.01) {
-		ptr=0;
-		setBrightness(k);
-		for(i=0; i<numLEDs; i++) {
-			setPixelColor(i, i*5, 64, i*2);
-		}
-		show();
-	}
-	for(k=0.5; k>=0; k-=.01) {
-		ptr=0;
-		setBrightness(k);
-		for(i=0; i<numLEDs; i++) {
-			setPixelColor(i, i*5, 64, i*2);
+			// We don't use striding
+			cbp->stride = 0;
+
+			// These are reserved
+			cbp->pad[0] = 0;
+			cbp->pad[1] = 0;
+
+			// Pointer to next block - 0 shuts down the DMA channel when transfer is complete
+			if(bytesLeft > 0) {
+				cbp->next = mem_virt_to_phys(&ctl->cb[buffer][i + 1]);
+			} else {
+				cbp->next = 0;
+				break;
+			}
 		}
-		show();
 	}
-	usleep(1000);
 
-	// Random color fade
-	srand(time(NULL));
-	uint8_t lastRed = 0;
-	uint8_t lastGreen = 0;
-	uint8_t lastBlue = 0;
-	uint8_t red, green, blue;
-	Color_t curPixel;
-	setBrightness(DEFAULT_BRIGHTNESS);
-	for(j=1; j<16; j++) {
-		ptr = 0;
-		if(j % 3) {
-			red = 120;
-			green = 64;
-			blue = 48;
-		} else if(j % 7) {
-			red = 255;
-			green = 255;
-			blue = 255;
+	// Testing
+	/*
+	ctl = (struct control_data_s *)virtbase;
+	ctl->sample[0] = 0x00000000;
+	ctl->sample[1] = 0x000000FA;
+	ctl->sample[2] = 0x0000FFFF;
+	ctl->sample[3] = 0xAAAAAAAA;
+	ctl->sample[4] = 0xF0F0F0F0;
+	ctl->sample[5] = 0x0A0A0A0A;
+	ctl->sample[6] = 0xF00F0000;
+	*/
+
+
+	// Stop any existing DMA transfers
+	// ---------------------------------------------------------------
+	dma_reg[DMA_CS] |= (1 << DMA_CS_ABORT);
+	usleep(100);
+	dma_reg[DMA_CS] = (1 << DMA_CS_RESET);
+	usleep(100);
+
+
+	// PWM or PCM
+	// ---------------------------------------------------------------
+	if(engine == &outputEngines[ENGINE_PCM]) {
+		initPCM();
+	} else {
+		initPWM();
+	}
+
+
+	// DMA
+	// ---------------------------------------------------------------
+	// Raise an interrupt when transfer is complete, which will set the INT flag in the CS register
+	SETBIT(dma_reg[DMA_CS], DMA_CS_INT);
+	usleep(100);
+	
+	// Clear the END flag (by setting it - this is a "write 1 to clear", or W1C, bit)
+	SETBIT(dma_reg[DMA_CS], DMA_CS_END);
+	usleep(100);
+	
+	// Send the physical address of the control block into the DMA controller
+	dma_reg[DMA_CONBLK_AD] = mem_virt_to_phys(ctl->cb[0]);
+	usleep(100);
+	
+	// Clear error flags, if any (these are also W1C bits)
+	// FIXME: Use a define instead of this
+	dma_reg[DMA_DEBUG] = 7;
+	usleep(100);
+}
+
+// When the frame we sent last will be out on the wire and latched by the LEDs
+static unsigned long long frameDoneNs;
+
+// Begin the transfer of one of the sample buffers. Doesn't wait for it to finish.
+void startTransfer(int buffer) {
+	unsigned long long now;
+
+	// Enable DMA
+	dma_reg[DMA_CONBLK_AD] = mem_virt_to_phys(ctl->cb[buffer]);
+	dma_reg[DMA_CS] = DMA_CS_CONFIGWORD | (1 << DMA_CS_ACTIVE);
+
+	// Enable PWM (or PCM). It stays on between frames, so we only have to give DMA a moment to
+	// fill the FIFO the first time around. Both PWM channels start together, so they take their
+	// words in turn.
+	if(engine == &outputEngines[ENGINE_PCM]) {
+		if(!(pcm_reg[PCM_CS] & (1 << PCM_CS_TXON))) {
+			usleep(100);
+			SETBIT(pcm_reg[PCM_CS], PCM_CS_TXON);
+		}
+	} else if(!(pwm_reg[PWM_CTL] & (1 << PWM_CTL_PWEN1))) {
+		usleep(100);
+		pwm_reg[PWM_CTL] |= (1 << PWM_CTL_PWEN1) | (numStrips == 2 ? (1 << PWM_CTL_PWEN2) : 0);
+	}
+	now = nowNs();
+	frameDoneNs = now + (unsigned long long)stripWords() * 32 * WIRE_BIT_NS + engine->latchNs;
+
+	if(simulate) {
+		simRunDMA(now);
+	}
+
+//	dumpPWM();
+//	dumpDMA();
+}
+
+// Is the last frame still on its way out? That includes the time it takes the LEDs to latch it,
+// because the next frame can't start until then.
+unsigned char ws2812_busy() {
+	if(simulate) {
+		simPoll();
+	}
+	if(dma_reg[DMA_CS] & (1 << DMA_CS_ACTIVE)) {
+		return true;
+	}
+	return nowNs() < frameDoneNs;
+}
+
+// Wait until the last frame has been sent and latched
+void ws2812_wait() {
+	unsigned long long now;
+	struct timespec ts;
+
+	while(ws2812_busy()) {
+		// Sleep until it should be done. If DMA is somehow still going after that, check back soon.
+		now = nowNs();
+		ts.tv_sec = 0;
+		ts.tv_nsec = 10000;
+		if(frameDoneNs > now) {
+			ts.tv_sec = (frameDoneNs - now) / 1000000000ULL;
+			ts.tv_nsec = (frameDoneNs - now) % 1000000000ULL;
+		}
+		nanosleep(&ts, NULL);
+	}
+}
+
+
+
+// =================================================================================================
+//	  ____ ___            .___       __           .____     ___________________          
+//	 |    |   \______   __| _/____ _/  |_  ____   |    |    \_   _____/\______ \   ______
+//	 |    |   /\____ \ / __ |\__  \\   __\/ __ \  |    |     |    __)_  |    |  \ /  ___/
+//	 |    |  / |  |_> > /_/ | / __ \|  | \  ___/  |    |___  |        \ |    `   \\___ \ 
+//	 |______/  |   __/\____ |(____  /__|  \___  > |_______ \/_______  //_______  /____  >
+//	           |__|        \/     \/          \/          \/        \/         \/     \/ 
+// =================================================================================================
+
+// Dithering
+// --------------------------------------------------------------------------------------------------
+// Brightness and gamma squeeze 256 levels into fewer: at brightness 0.2, the strip only gets 52 of
+// them, so slow fades go up in visible steps. With setDithering(true) (or --dither), show() works
+// out every channel as a 16-bit level (8 bits, and 8 bits of fraction) instead, sends the whole
+// part, and carries the fraction over to the next frame. Over a few frames, the LEDs average out to
+// the level in between. That only works if frames keep coming, so while dithering is on, frames
+// go out as fast as the wire allows, whatever setFrameRate() says, and the loops that show() on
+// demand (--daemon, --shm, --opc) keep sending the last frame while they wait. Short strips are
+// best: at 1000 pixels the wire only manages 30-odd frames a second, and the dithering flickers.
+//
+// It also gives you 16-bit pixels. setPixelColor16() and friends keep the full 16 bits in
+// LEDBuffer16, and the nearest 8-bit color in LEDBuffer (so everything else still sees it). Setting
+// a pixel any other way (anything that calls markPixelsDirty()) sets its 16-bit color to match,
+// v * 257, even if the 8-bit color is the same as before.
+//
+// Per pixel, it's a few table lookups and adds on top of the encoding. The tables have the color
+// correction built in, like the wire tables, and the frame is encoded with no correction.
+typedef struct {
+	uint16_t r;
+	uint16_t g;
+	uint16_t b;
+} Color16_t;
+
+unsigned char dithering;					// Set by setDithering()
+Color16_t *LEDBuffer16;						// numLEDs 16-bit pixels, while dithering is on
+static Color_t *ditherError;				// Fraction carried over from the last frame, per channel
+static Color_t *ditherFrame;				// What show() sent last (after color correction)
+static uint16_t ditherLUT[3][256];			// 8-bit value -> corrected level (8.8 fixed point)
+static uint16_t ditherLUT16[3][258];		// The same, every 256 steps of a 16-bit value (plus one to spare)
+
+// Work out the tables for the current brightness, gamma and white balance (see buildColorLUT())
+void buildDitherLUT() {
+	int c, i;
+	float level;
+
+	if(!dithering) {
+		return;
+	}
+	for(c = 0; c < 3; c++) {
+		for(i = 0; i < 256; i++) {
+			level = colorGamma == 1.0 ? i : 255.0 * powf(i / 255.0, colorGamma);
+			ditherLUT[c][i] = (uint16_t)(level * brightness * whiteBalance[c] * 256 + 0.5);
+		}
+		for(i = 0; i <= 256; i++) {
+			level = 255.0 * powf(i / 256.0, colorGamma);
+			ditherLUT16[c][i] = (uint16_t)(level * brightness * whiteBalance[c] * 256 + 0.5);
+		}
+		ditherLUT16[c][257] = ditherLUT16[c][256];
+	}
+}
+
+// The nearest 8-bit value to a 16-bit one (65535 is 255, so that's dividing by 257)
+static inline uint8_t value16to8(unsigned int v) {
+	return (v + 128 - (v >> 8)) >> 8;
+}
+
+// Corrected level of channel c of a pixel, whose 8-bit value is v, and 16-bit value v16. A plain
+// 8-bit color has its own table entry.
+static inline unsigned int ditherLevel(int c, uint8_t v, unsigned int v16) {
+	unsigned int x, i, f;
+
+	if(v16 == v * 257) {
+		return ditherLUT[c][v];
+	}
+	// 0-65535 -> 0-65536, and interpolate between the entries either side
+	x = v16 + (v16 >> 15);
+	i = x >> 8;
+	f = x & 255;
+	return ditherLUT16[c][i] + (((ditherLUT16[c][i + 1] - ditherLUT16[c][i]) * f) >> 8);
+}
+
+// Add on the fraction left over from last time, send the whole part, and keep the new fraction
+static inline uint8_t ditherChannel(unsigned int level, uint8_t *error) {
+	level += *error;
+	*error = level & 255;
+	return level >> 8;
+}
+
+// Dither pixels [first, end) into ditherFrame
+static void ditherPixels(unsigned int first, unsigned int end) {
+	unsigned int i;
+
+	for(i = first; i < end; i++) {
+		ditherFrame[i].r = ditherChannel(ditherLevel(0, LEDBuffer[i].r, LEDBuffer16[i].r), &ditherError[i].r);
+		ditherFrame[i].g = ditherChannel(ditherLevel(1, LEDBuffer[i].g, LEDBuffer16[i].g), &ditherError[i].g);
+		ditherFrame[i].b = ditherChannel(ditherLevel(2, LEDBuffer[i].b, LEDBuffer16[i].b), &ditherError[i].b);
+	}
+}
+
+// Turn dithering (and 16-bit pixels) on or off. Call it after initHardware(). The 16-bit pixels
+// start out as whatever LEDBuffer has.
+unsigned char setDithering(unsigned char on) {
+	unsigned int i;
+
+	if(!on) {
+		dithering = false;
+		free(LEDBuffer16);
+		free(ditherError);
+		free(ditherFrame);
+		LEDBuffer16 = NULL;
+		ditherError = ditherFrame = NULL;
+		growDirtyRanges(0, numLEDs);
+		return true;
+	}
+	if(dithering) {
+		return true;
+	}
+	LEDBuffer16 = malloc(numLEDs * sizeof(Color16_t));
+	ditherError = malloc(numLEDs * sizeof(Color_t));
+	ditherFrame = malloc(numLEDs * sizeof(Color_t));
+	if(!LEDBuffer16 || !ditherError || !ditherFrame) {
+		printf("Not enough memory to dither %u pixels\n", numLEDs);
+		setDithering(false);
+		return false;
+	}
+	for(i = 0; i < numLEDs; i++) {
+		LEDBuffer16[i].r = LEDBuffer[i].r * 257;
+		LEDBuffer16[i].g = LEDBuffer[i].g * 257;
+		LEDBuffer16[i].b = LEDBuffer[i].b * 257;
+
+		// Start every channel off with a different fraction, so that neighbouring pixels on the
+		// same level don't all flick up and down together
+		ditherError[i].r = (i * 3 + 0) * 2654435761u >> 24;
+		ditherError[i].g = (i * 3 + 1) * 2654435761u >> 24;
+		ditherError[i].b = (i * 3 + 2) * 2654435761u >> 24;
+	}
+	dithering = true;
+	buildDitherLUT();
+	return true;
+}
+
+// Copy count 16-bit pixels from src into pixels [first, first+count)
+PixelError_t setPixels16(unsigned int first, unsigned int count, const Color16_t *src) {
+	unsigned int i;
+
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(src == NULL && count > 0) {
+		return PIXEL_BAD_ARGUMENT;
+	}
+	if(LEDBuffer16) {
+		memmove(LEDBuffer16 + first, src, count * sizeof(Color16_t));
+		src = LEDBuffer16 + first;
+	}
+	for(i = 0; i < count; i++) {
+		LEDBuffer[first + i].r = value16to8(src[i].r);
+		LEDBuffer[first + i].g = value16to8(src[i].g);
+		LEDBuffer[first + i].b = value16to8(src[i].b);
+	}
+	growDirtyRanges(first, count);
+	return PIXEL_OK;
+}
+
+// Pixels [first, first+count) were set in 8 bits: their 16-bit colors are the same, to match
+void syncPixels16(unsigned int first, unsigned int count) {
+	unsigned int i;
+
+	if(!LEDBuffer16 || first >= numLEDs) {
+		return;
+	}
+	if(count > numLEDs - first) {
+		count = numLEDs - first;
+	}
+	for(i = first; i < first + count; i++) {
+		LEDBuffer16[i].r = LEDBuffer[i].r * 257;
+		LEDBuffer16[i].g = LEDBuffer[i].g * 257;
+		LEDBuffer16[i].b = LEDBuffer[i].b * 257;
+	}
+}
+
+// The loops that show() on demand call this while they wait: should they send the last frame
+// again, to keep the dithering going? (Not if something's changed, and hasn't been shown yet.)
+unsigned char ditherRefreshWanted() {
+	return dithering && changedRange.first >= changedRange.end;
+}
+
+// Set pixel color (48-bit color). Without dithering, it's rounded to 8 bits.
+unsigned char setPixelColor16(unsigned int pixel, uint16_t r, uint16_t g, uint16_t b) {
+	Color16_t c = { r, g, b };
+
+	return setPixels16(pixel, 1, &c) == PIXEL_OK;
+}
+
+// Get pixel color, in 16 bits (without dithering, that's the 8-bit one, times 257)
+Color16_t getPixelColor16(unsigned int pixel) {
+	Color16_t c = { 0, 0, 0 };
+
+	if(pixel >= numLEDs) {
+		return c;
+	}
+	if(LEDBuffer16) {
+		return LEDBuffer16[pixel];
+	}
+	c.r = LEDBuffer[pixel].r * 257;
+	c.g = LEDBuffer[pixel].g * 257;
+	c.b = LEDBuffer[pixel].b * 257;
+	return c;
+}
+
+// Worker threads
+// --------------------------------------------------------------------------------------------------
+// A Pi 2 or 3 has four cores, and on a long strip, one of them can spend a while working out the
+// pixels and encoding them. Both jobs split up nicely by pixel, so with setWorkerThreads() (or
+// --threads), a pool of threads shares them out. Each thread gets its own run of 32-pixel chunks.
+// 32 pixels are exactly 72 words, so every chunk starts on a word of its own, and the threads
+// write separate parts of the DMA buffer (or LEDBuffer) without any locking. The thread that
+// asked does a share too, and then waits for the rest.
+//
+// It's one thread (no pool) unless you ask. Waking threads up costs a few microseconds, so short
+// jobs aren't split at all.
+
+#define MAX_WORKERS				4
+#define WORK_CHUNK_PIXELS		32				// 72 words
+#define PARALLEL_MIN_PIXELS		512				// Anything shorter is done by the caller alone
+
+typedef void (*WorkFunction_t)(void *arg, unsigned int first, unsigned int end);
+
+static unsigned int numWorkers = 1;				// Threads sharing the work, including the caller
+static pthread_t workerThreads[MAX_WORKERS];
+static pthread_mutex_t workMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+static unsigned long workGeneration;			// Goes up by one for each job
+static unsigned long workerSeen[MAX_WORKERS];	// The last job each worker took (or was started after)
+static unsigned int workPending;				// Threads still working on this one
+static unsigned char workQuit;
+
+// The job
+static WorkFunction_t workFunction;
+static void *workArg;
+static unsigned int workFirst, workEnd;
+
+// Which pixels worker number n does: its share of the chunks
+static void workSlice(unsigned int n, unsigned int *first, unsigned int *end) {
+	unsigned int chunks = (workEnd - workFirst + WORK_CHUNK_PIXELS - 1) / WORK_CHUNK_PIXELS;
+	unsigned int share = (chunks + numWorkers - 1) / numWorkers;
+
+	*first = workFirst + n * share * WORK_CHUNK_PIXELS;
+	*end = *first + share * WORK_CHUNK_PIXELS;
+	if(*first > workEnd) {
+		*first = workEnd;
+	}
+	if(*end > workEnd) {
+		*end = workEnd;
+	}
+}
+
+static void *workerThread(void *arg) {
+	unsigned int n = (uintptr_t)arg;
+	unsigned int first, end;
+
+	pthread_mutex_lock(&workMutex);
+	for(;;) {
+		while(workGeneration == workerSeen[n] && !workQuit) {
+			pthread_cond_wait(&workReady, &workMutex);
+		}
+		if(workQuit) {
+			break;
+		}
+		workerSeen[n] = workGeneration;
+		workSlice(n, &first, &end);
+		pthread_mutex_unlock(&workMutex);
+
+		if(first < end) {
+			workFunction(workArg, first, end);
+		}
+
+		pthread_mutex_lock(&workMutex);
+		if(--workPending == 0) {
+			pthread_cond_signal(&workDone);
+		}
+	}
+	pthread_mutex_unlock(&workMutex);
+	return NULL;
+}
+
+// Share the work out between n threads (1 to MAX_WORKERS; 1 means the caller does it all)
+unsigned char setWorkerThreads(unsigned int n) {
+	sigset_t all, old;
+	unsigned int i;
+	int err;
+
+	if(n < 1 || n > MAX_WORKERS) {
+		printf("Worker threads have to be between 1 and %d.\n", MAX_WORKERS);
+		return false;
+	}
+
+	// Stop the old pool
+	pthread_mutex_lock(&workMutex);
+	workQuit = true;
+	pthread_cond_broadcast(&workReady);
+	pthread_mutex_unlock(&workMutex);
+	for(i = 1; i < numWorkers; i++) {
+		pthread_join(workerThreads[i], NULL);
+	}
+
+	// Start the new one. Worker 0 is whoever calls runParallel(). The new workers count the last
+	// job as seen, or they'd do it again (its arg may be long gone), and workPending would come up
+	// short. We hold the lock until numWorkers is final, so none of them see it change. They block
+	// all signals, so Ctrl+C and friends always land on the main thread, which cleans up.
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_mutex_lock(&workMutex);
+	workQuit = false;
+	numWorkers = n;
+	for(i = 1; i < n; i++) {
+		workerSeen[i] = workGeneration;
+		// pthread_create() hands back its error rather than setting errno
+		err = pthread_create(&workerThreads[i], NULL, workerThread, (void *)(uintptr_t)i);
+		if(err != 0) {
+			printf("Failed to start worker thread %u: %s\n", i, strerror(err));
+			numWorkers = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&workMutex);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return numWorkers == n;
+}
+
+// Run fn(arg, first, end) over pixels [first, end), shared out between the threads, and wait until
+// it's all done. first should be a multiple of 4, so every chunk starts on a whole word.
+void runParallel(WorkFunction_t fn, void *arg, unsigned int first, unsigned int end) {
+	unsigned int sliceFirst, sliceEnd;
+
+	if(numWorkers == 1 || end - first < PARALLEL_MIN_PIXELS) {
+		fn(arg, first, end);
+		return;
+	}
+
+	pthread_mutex_lock(&workMutex);
+	workFunction = fn;
+	workArg = arg;
+	workFirst = first;
+	workEnd = end;
+	workPending = numWorkers - 1;
+	workGeneration++;
+	pthread_cond_broadcast(&workReady);
+	workSlice(0, &sliceFirst, &sliceEnd);
+	pthread_mutex_unlock(&workMutex);
+
+	fn(arg, sliceFirst, sliceEnd);
+
+	pthread_mutex_lock(&workMutex);
+	while(workPending) {
+		pthread_cond_wait(&workDone, &workMutex);
+	}
+	pthread_mutex_unlock(&workMutex);
+}
+
+// Encode pixels [first, end) of each strip into a DMA sample buffer (arg). show()'s job.
+static void encodeSlice(void *arg, unsigned int first, unsigned int end) {
+	uint32_t *sample = arg;
+
+	if(dithering) {
+		// Dither the pixels first, then encode what that came to, with no more color correction
+		ditherPixels(first, end);
+		if(numStrips == 2) {
+			ditherPixels(stripLength + first, stripLength + end);
+			encodeDualWith(encodePixelsRaw, sample + (first / 4) * 18, ditherFrame + first, ditherFrame + stripLength + first, end - first);
+		} else {
+			encodePixelsRaw(sample + (first / 4) * 9, ditherFrame + first, end - first);
+		}
+	} else if(numStrips == 2) {
+		encodePixelsDual(sample + (first / 4) * 18, LEDBuffer + first, LEDBuffer + stripLength + first, end - first);
+	} else {
+		encodePixels(sample + (first / 4) * 9, LEDBuffer + first, end - first);
+	}
+}
+
+// Frame cache
+// --------------------------------------------------------------------------------------------------
+// Lots of effects go round in circles: rainbow() shows the same 256 frames over and over, and
+// theaterChase() has just 3. With setFrameCacheSize() (or --cache), show() keeps the frames it
+// encodes, looked up by a hash of the pixels and the color tables (brightness, gamma and white
+// balance). When a frame comes round again, it's copied into the DMA buffer instead of encoded.
+// Once the cache is full, the frame that was used longest ago makes way.
+//
+// It's off unless you ask for it, because it isn't free: every frame has to be hashed, and every
+// new frame copied into the cache. It pays off when frames repeat, and when encoding is slow (like
+// the table encoder on a Pi Zero). We check the pixels too, not just the hash, so a collision can't
+// put the wrong frame on the strip.
+
+typedef struct FrameCacheEntry_s {
+	struct FrameCacheEntry_s *newer;		// Least recently used list
+	struct FrameCacheEntry_s *older;
+	struct FrameCacheEntry_s *next;			// Next entry in the same hash bucket
+	uint64_t hash;
+	uint64_t lutHash;
+	uint32_t *words;						// The frame, as it goes to the DMA engine
+	Color_t *pixels;						// ...and as it was in LEDBuffer
+} FrameCacheEntry_t;
+
+static size_t frameCacheLimit;				// Bytes we're allowed (0 = no cache)
+static unsigned int frameCacheWords;		// Words in each frame (the cache is emptied when it changes)
+static unsigned int frameCacheMax;			// How many frames fit
+static unsigned int frameCacheCount;
+static unsigned int frameCacheBuckets;		// A power of 2
+static FrameCacheEntry_t **frameCacheTable;
+static FrameCacheEntry_t *frameCacheNewest;
+static FrameCacheEntry_t *frameCacheOldest;
+
+// Statistics, printed by dumpFrameStats()
+unsigned long frameCacheHits;
+unsigned long frameCacheMisses;
+unsigned long frameCacheEvictions;
+
+// A quick 64-bit hash. It runs 4 lanes of 8 bytes side by side, so each multiply doesn't have to
+// wait for the last one (that made it about twice as fast), and then folds them together.
+#define HASH_PRIME		0x9E3779B97F4A7C15ULL
+#define HASH_MIX(h, w)	((h) = ((h) ^ (w)) * HASH_PRIME, (h) ^= (h) >> 32)
+
+static uint64_t hashBytes(const void *data, size_t len, uint64_t h) {
+	const unsigned char *p = data;
+	uint64_t w[4], lane[4] = { h, h ^ 0x5555555555555555ULL, h ^ 0xAAAAAAAAAAAAAAAAULL, ~h };
+
+	for(; len >= 32; p += 32, len -= 32) {
+		memcpy(w, p, 32);
+		HASH_MIX(lane[0], w[0]);
+		HASH_MIX(lane[1], w[1]);
+		HASH_MIX(lane[2], w[2]);
+		HASH_MIX(lane[3], w[3]);
+	}
+	h = lane[0] ^ ((lane[1] << 16) | (lane[1] >> 48)) ^ ((lane[2] << 32) | (lane[2] >> 32))
+		^ ((lane[3] << 48) | (lane[3] >> 16));
+	for(; len >= 8; p += 8, len -= 8) {
+		memcpy(w, p, 8);
+		HASH_MIX(h, w[0]);
+	}
+	w[0] = 0;
+	memcpy(w, p, len);
+	HASH_MIX(h, w[0] ^ len);
+	return h * HASH_PRIME;
+}
+
+static void emptyFrameCache() {
+	FrameCacheEntry_t *entry;
+
+	while(frameCacheNewest) {
+		entry = frameCacheNewest;
+		frameCacheNewest = entry->older;
+		free(entry);
+	}
+	frameCacheOldest = 0;
+	frameCacheCount = 0;
+	free(frameCacheTable);
+	frameCacheTable = 0;
+	frameCacheMax = 0;
+}
+
+// Keep up to this many bytes of encoded frames (0 turns the cache off). Empties the cache.
+void setFrameCacheSize(size_t bytes) {
+	emptyFrameCache();
+	frameCacheLimit = bytes;
+	frameCacheWords = 0;
+}
+
+// Size the cache for the frames we're sending now. Returns false if not even one fits.
+static unsigned char frameCacheReady() {
+	size_t entryBytes;
+
+	if(frameCacheWords == transferWords() && frameCacheTable) {
+		return true;
+	}
+	emptyFrameCache();
+	frameCacheWords = transferWords();
+	entryBytes = sizeof(FrameCacheEntry_t) + frameCacheWords * sizeof(uint32_t) + numLEDs * sizeof(Color_t);
+	frameCacheMax = frameCacheLimit / entryBytes;
+	if(frameCacheMax == 0) {
+		return false;
+	}
+	for(frameCacheBuckets = 1; frameCacheBuckets < frameCacheMax; frameCacheBuckets <<= 1);
+	frameCacheTable = calloc(frameCacheBuckets, sizeof(FrameCacheEntry_t *));
+	if(frameCacheTable == NULL) {
+		fatal("Failed to allocate the frame cache\n");
+	}
+	return true;
+}
+
+// Move an entry to the front of the least recently used list
+static void frameCacheTouch(FrameCacheEntry_t *entry) {
+	if(entry == frameCacheNewest) {
+		return;
+	}
+	if(entry->newer) {
+		entry->newer->older = entry->older;
+	}
+	if(entry->older) {
+		entry->older->newer = entry->newer;
+	} else if(frameCacheOldest == entry) {
+		frameCacheOldest = entry->newer;
+	}
+	entry->newer = 0;
+	entry->older = frameCacheNewest;
+	if(frameCacheNewest) {
+		frameCacheNewest->newer = entry;
+	}
+	frameCacheNewest = entry;
+	if(frameCacheOldest == 0) {
+		frameCacheOldest = entry;
+	}
+}
+
+// What LEDBuffer (and the color tables) hash to right now
+static uint64_t frameCacheHash() {
+	if(colorLUTHash == 0) {
+		colorLUTHash = hashBytes(greenLUT, 256, hashBytes(redLUT, 256, hashBytes(blueLUT, 256, 1))) | 1;
+	}
+	return hashBytes(LEDBuffer, numLEDs * sizeof(Color_t), colorLUTHash);
+}
+
+// If we've seen this frame before, copy it into dest and return true
+static unsigned char frameCacheFetch(uint32_t *dest, uint64_t hash) {
+	FrameCacheEntry_t *entry;
+
+	if(!frameCacheReady()) {
+		return false;
+	}
+	for(entry = frameCacheTable[hash & (frameCacheBuckets - 1)]; entry; entry = entry->next) {
+		if(entry->hash == hash && entry->lutHash == colorLUTHash
+				&& memcmp(entry->pixels, LEDBuffer, numLEDs * sizeof(Color_t)) == 0) {
+			memcpy(dest, entry->words, frameCacheWords * sizeof(uint32_t));
+			frameCacheTouch(entry);
+			frameCacheHits++;
+			return true;
+		}
+	}
+	frameCacheMisses++;
+	return false;
+}
+
+// Keep the frame that was just encoded into src
+static void frameCacheStore(uint32_t *src, uint64_t hash) {
+	FrameCacheEntry_t *entry, **link;
+
+	if(!frameCacheReady()) {
+		return;
+	}
+	if(frameCacheCount < frameCacheMax) {
+		entry = malloc(sizeof(FrameCacheEntry_t) + frameCacheWords * sizeof(uint32_t) + numLEDs * sizeof(Color_t));
+		if(entry == NULL) {
+			return;
+		}
+		entry->words = (uint32_t *)(entry + 1);
+		entry->pixels = (Color_t *)(entry->words + frameCacheWords);
+		entry->newer = entry->older = 0;
+		frameCacheCount++;
+	} else {
+		// Full. Reuse the least recently used one.
+		entry = frameCacheOldest;
+		for(link = &frameCacheTable[entry->hash & (frameCacheBuckets - 1)]; *link != entry; link = &(*link)->next);
+		*link = entry->next;
+		frameCacheEvictions++;
+	}
+
+	entry->hash = hash;
+	entry->lutHash = colorLUTHash;
+	memcpy(entry->words, src, frameCacheWords * sizeof(uint32_t));
+	memcpy(entry->pixels, LEDBuffer, numLEDs * sizeof(Color_t));
+	entry->next = frameCacheTable[hash & (frameCacheBuckets - 1)];
+	frameCacheTable[hash & (frameCacheBuckets - 1)] = entry;
+	frameCacheTouch(entry);
+}
+
+// Frame scheduler
+// --------------------------------------------------------------------------------------------------
+// show() starts each frame on a fixed schedule of absolute deadlines, so frames don't drift the way
+// they would with a sleep after each one. The period is whatever setFramePeriod()/setFrameRate()
+// asked for, but never less than the time it takes to send a frame and latch it.
+unsigned long long framePeriodNs;		// Requested period (0 = as fast as the wire allows)
+static unsigned long long nextFrameNs;	// Deadline for the next frame to start (0 = no schedule yet)
+static unsigned long long lastFrameNs;	// When the last frame started
+
+// Statistics, printed by dumpFrameStats()
+unsigned long frameCount;				// Frames shown
+unsigned long skippedFrames;			// ...of which didn't change anything, so weren't sent
+unsigned long lateFrames;				// Frames that weren't ready to go until after their deadline
+unsigned long droppedFrames;			// Deadlines that went by without a frame at all
+unsigned long long jitterSumNs;			// How far after their deadlines on-time frames started
+unsigned long long jitterMaxNs;
+
+// The shortest possible frame period: every word we send (on each channel), plus the latch time
+unsigned long long minFramePeriodNs() {
+	return (unsigned long long)stripWords() * 32 * WIRE_BIT_NS + engine->latchNs;
+}
+
+// Set the time between frames in nanoseconds. 0 means "as fast as the wire allows".
+void setFramePeriod(unsigned long long ns) {
+	framePeriodNs = ns;
+	nextFrameNs = lastFrameNs ? lastFrameNs + ns : 0;
+}
+
+// Set the frame rate in frames per second. 0 means "as fast as the wire allows".
+void setFrameRate(float fps) {
+	setFramePeriod(fps > 0 ? 1000000000ULL / fps : 0);
+}
+
+// Forget the schedule, so the next frame goes out as soon as the last one has latched. This is for
+// callers that show() on demand (like the daemon), so the time they spend idle doesn't count as
+// late or dropped frames.
+void restartFrameSchedule() {
+	nextFrameNs = 0;
+}
+
+// Sleep until it's time for the next frame to go out and the last one has latched
+void waitForFrame() {
+	unsigned long long period = framePeriodNs > minFramePeriodNs() && !dithering ? framePeriodNs : minFramePeriodNs();
+	unsigned long long now = nowNs();
+	unsigned long long missed;
+	unsigned char late = false;
+	struct timespec deadline;
+
+	if(nextFrameNs == 0) {
+		// First frame: start the schedule now
+		nextFrameNs = now;
+	} else if(now > nextFrameNs) {
+		// Missed the deadline. If we missed whole frames, skip their deadlines rather than trying
+		// to catch up, so the schedule stays in phase.
+		late = true;
+		lateFrames++;
+		missed = (now - nextFrameNs) / period;
+		droppedFrames += missed;
+		nextFrameNs += missed * period;
+	} else {
+		deadline.tv_sec = nextFrameNs / 1000000000ULL;
+		deadline.tv_nsec = nextFrameNs % 1000000000ULL;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+	}
+
+	// The last frame should be done by now, but we can't start until it is
+	ws2812_wait();
+
+	now = nowNs();
+	if(!late && now >= nextFrameNs) {
+		jitterSumNs += now - nextFrameNs;
+		if(now - nextFrameNs > jitterMaxNs) {
+			jitterMaxNs = now - nextFrameNs;
+		}
+	}
+	frameCount++;
+	lastFrameNs = now;
+	nextFrameNs += period;
+}
+
+// Print the frame scheduler's statistics
+void dumpFrameStats() {
+	unsigned long onTime = frameCount - lateFrames;
+	printf("Frame scheduler\n");
+	printf("	        Frames: %lu\n", frameCount);
+	printf("	    Min period: %.3f ms\n", minFramePeriodNs() / 1e6);
+	printf("	Skipped frames: %lu\n", skippedFrames);
+	printf("	   Late frames: %lu\n", lateFrames);
+	printf("	Dropped frames: %lu\n", droppedFrames);
+	printf("	        Jitter: %.1f us avg, %.1f us max\n", onTime ? jitterSumNs / 1e3 / onTime : 0, jitterMaxNs / 1e3);
+	if(frameCacheLimit) {
+		printf("	   Frame cache: %lu hits, %lu misses, %lu evicted (%u frames)\n",
+			frameCacheHits, frameCacheMisses, frameCacheEvictions, frameCacheCount);
+	}
+	printf("\n");
+}
+
+// Recording and playback
+// --------------------------------------------------------------------------------------------------
+// With --record, every frame show() sends is also written to a file, exactly as it went to the DMA
+// engine, along with when it went. --play sends them again, straight from the file, at the same
+// times. There's nothing to compute and nothing to encode, so a show that takes a lot of effort
+// to work out (or a Pi Zero that's short of breath) plays back as fast as the wire can take it.
+// Recording works with --simulate too, so you can render a show on something bigger than a Pi.
+//
+// The file is a RecordingHeader_t, and then the frames, each one a RecordingFrame_t followed by
+// frameWords words. Everything is in the Pi's byte order (little endian). The words only make sense
+// to the same engine, with the same strips, so playback sets those up to match the file.
+
+#define RECORDING_MAGIC		"WS2812RF"
+#define RECORDING_VERSION	1
+
+typedef struct {
+	char magic[8];					// RECORDING_MAGIC
+	uint32_t version;
+	uint32_t engine;				// Index into outputEngines[]
+	uint32_t numStrips;
+	uint32_t stripLength;
+	uint32_t frameWords;			// transferWords() when it was recorded
+	uint32_t reserved;
+} RecordingHeader_t;
+
+typedef struct {
+	uint64_t timeNs;				// When the frame started, from the start of the recording
+} RecordingFrame_t;
+
+static FILE *recordFile;
+static unsigned long long recordStartNs;
+static unsigned long recordedFrames;
+
+// Finish the file. Safe to call when we're not recording.
+void stopRecording() {
+	if(recordFile) {
+		if(fclose(recordFile) != 0) {
+			printf("Failed to finish the recording: %m\n");
+		}
+		recordFile = 0;
+		printf("Recorded %lu frames\n", recordedFrames);
+	}
+}
+
+// Start recording everything show() sends to path. Call after initHardware().
+void startRecording(char *path) {
+	RecordingHeader_t header;
+
+	recordFile = fopen(path, "wb");
+	if(recordFile == NULL) {
+		fatal("Failed to create %s: %m\n", path);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+	header.version = RECORDING_VERSION;
+	header.engine = engine - outputEngines;
+	header.numStrips = numStrips;
+	header.stripLength = stripLength;
+	header.frameWords = transferWords();
+	if(fwrite(&header, sizeof(header), 1, recordFile) != 1) {
+		fatal("Failed to write %s: %m\n", path);
+	}
+	recordStartNs = 0;
+	recordedFrames = 0;
+	atexit(stopRecording);
+}
+
+// Called by show() once a frame is on its way
+static void recordFrame(int buffer) {
+	RecordingFrame_t frame;
+
+	if(recordStartNs == 0) {
+		recordStartNs = lastFrameNs;
+	}
+	frame.timeNs = lastFrameNs - recordStartNs;
+	if(fwrite(&frame, sizeof(frame), 1, recordFile) != 1
+			|| fwrite(ctl->sample[buffer], sizeof(uint32_t), transferWords(), recordFile) != transferWords()) {
+		fatal("Failed to write the recording: %m\n");
+	}
+	recordedFrames++;
+}
+
+// The recording --play is playing
+static uint8_t *playMap;
+static size_t playSize;
+static RecordingHeader_t *playHeader;
+static unsigned long playFrames;
+
+// Map a recording and check it over. Call before initHardware(), so it can be set up the same way
+// the recording was (initHardware(playHeader->stripLength, playHeader->numStrips)).
+void openRecording(char *path) {
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		fatal("Failed to open %s: %m\n", path);
+	}
+	if(fstat(fd, &st) < 0) {
+		fatal("Failed to stat %s: %m\n", path);
+	}
+	if(st.st_size < sizeof(RecordingHeader_t)) {
+		fatal("%s isn't a recording\n", path);
+	}
+	playSize = st.st_size;
+	playMap = mmap(NULL, playSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(playMap == MAP_FAILED) {
+		playMap = 0;
+		fatal("Failed to map %s: %m\n", path);
+	}
+	madvise(playMap, playSize, MADV_SEQUENTIAL);
+
+	playHeader = (RecordingHeader_t *)playMap;
+	if(memcmp(playHeader->magic, RECORDING_MAGIC, sizeof(playHeader->magic)) != 0) {
+		fatal("%s isn't a recording\n", path);
+	}
+	if(playHeader->version != RECORDING_VERSION) {
+		fatal("%s is a version %u recording (we can play version %d)\n", path, playHeader->version, RECORDING_VERSION);
+	}
+	if(playHeader->engine >= sizeof(outputEngines) / sizeof(outputEngines[0])
+			|| playHeader->numStrips < 1 || playHeader->numStrips > MAX_STRIPS || playHeader->stripLength < 1) {
+		fatal("%s is damaged\n", path);
+	}
+
+	// A frame cut short at the end (say the recorder was killed while writing it) is left out
+	playFrames = (playSize - sizeof(RecordingHeader_t))
+		/ (sizeof(RecordingFrame_t) + playHeader->frameWords * sizeof(uint32_t));
+	engine = &outputEngines[playHeader->engine];
+}
+
+// Play the recording once, on the schedule it was recorded with (or as fast as the wire allows, if
+// that's slower)
+void playRecording() {
+	size_t frameBytes = sizeof(RecordingFrame_t) + playHeader->frameWords * sizeof(uint32_t);
+	uint8_t *frame = playMap + sizeof(RecordingHeader_t);
+	unsigned long long startNs = nowNs();
+	unsigned long long deadline;
+	struct timespec ts;
+	unsigned long i;
+
+	if(playHeader->frameWords != transferWords()) {
+		fatal("The recording has %u words per frame, but we send %u\n", playHeader->frameWords, transferWords());
+	}
+
+	for(i = 0; i < playFrames; i++, frame += frameBytes) {
+		deadline = startNs + ((RecordingFrame_t *)frame)->timeNs;
+		ts.tv_sec = deadline / 1000000000ULL;
+		ts.tv_nsec = deadline % 1000000000ULL;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+		// Straight into the DMA buffer that isn't on the wire, then off it goes when the wire's free
+		memcpy(ctl->sample[backBuffer], frame + sizeof(RecordingFrame_t), playHeader->frameWords * sizeof(uint32_t));
+		ws2812_wait();
+		startTransfer(backBuffer);
+		backBuffer = (backBuffer + 1) % NUM_BUFFERS;
+		frameCount++;
+	}
+
+	// The DMA buffers are full of the recording now, not LEDBuffer, so the next show() has to
+	// encode all of it
+	growDirtyRanges(0, numLEDs);
+}
+
+
+// Read the pixels the back buffer is missing from LEDBuffer[], translate them into wire format,
+// and write them straight into it (it isn't being sent right now). Every 4 pixels fill exactly 9
+// words, so we widen the range to whole groups of 4, and the encoder never has to merge with words
+// that are already there.
+static void encodeStale() {
+	PixelRange_t *stale = &staleRange[backBuffer];
+	unsigned int first, end;
+
+	first = stale->first;
+	end = stale->end;
+	if(dithering) {
+		first = 0;
+		end = numLEDs;
+	}
+
+	// With two strips, their words are interleaved, so we redo the same stretch of both
+	if(numStrips == 2 && first < end) {
+		if(first >= stripLength) {
+			first -= stripLength;
+			end -= stripLength;
+		} else if(end > stripLength) {
+			first = 0;
+			end = stripLength;
+		}
+	}
+
+	first &= ~3;
+	end = (end + 3) & ~3;
+	if(end > stripLength) {
+		end = stripLength;
+	}
+	stale->first = stale->end = 0;
+	if(first < end) {
+		unsigned long long encodeStart = simulate ? nowNs() : 0;
+		unsigned char cache = frameCacheLimit && !dithering;
+		uint64_t hash = cache ? frameCacheHash() : 0;
+
+		// If the frame's in the cache, that's the whole thing sorted. If not, we encode what's
+		// stale, and then the buffer has the whole frame in it, ready to cache. (Dithered frames
+		// never come round again.)
+		if(!cache || !frameCacheFetch(ctl->sample[backBuffer], hash)) {
+			runParallel(encodeSlice, ctl->sample[backBuffer], first, end);
+			if(cache) {
+				frameCacheStore(ctl->sample[backBuffer], hash);
+			}
+		}
+		if(simulate) {
+			simEncodeNs += nowNs() - encodeStart;
+		}
+	}
+}
+
+void show() {
+
+	// Clear out the PWM buffer
+	// Disabled, because we will overwrite the buffer anyway.
+
+	// Nothing changed since the last frame, which is already on the strip (or on its way). Keep to
+	// the schedule, but don't bother sending it again. (Unless we're dithering: then every frame is
+	// different, and all of it has to be worked out again.)
+	if(changedRange.first >= changedRange.end && !dithering) {
+		waitForFrame();
+		skippedFrames++;
+		return;
+	}
+
+	changedRange.first = changedRange.end = 0;
+	encodeStale();
+
+	// Wait for this frame's turn (which includes waiting for the previous frame to latch), then send
+	// it. We don't wait for this one. The caller can build the next frame meanwhile, and the next
+	// show() (or ws2812_wait()) will wait for it.
+	waitForFrame();
+	startTransfer(backBuffer);
+	if(simulate) {
+		if(dithering) {
+			simCheckWire(ditherFrame, numLEDs);
+		} else {
+			simCheckFrame(LEDBuffer, numLEDs);
+		}
+	}
+	if(recordFile) {
+		recordFrame(backBuffer);
+	}
+	backBuffer = (backBuffer + 1) % NUM_BUFFERS;
+
+/*
+
+This is the old FIFO-filling code.
+The FIFO only has enough words for about 7 LEDs, which is why we use DMA instead!
+
+	for(i=0; i<NUM_DATA_WORDS; i++) {
+		
+		// That done, we add the word to the FIFO
+		printf("Adding word to FIFO: ");
+		printBinary(PWMWaveform[i], 32);
+		printf("\n");
+		pwm_reg[PWM_FIF1] = PWMWaveform[i];
+//		*(pwm + PWM_FIF1) = 0xACAC00F0;	// A test pattern easily visible on an oscilloscope, but not WS2812 compatible
+		usleep(20);
+	}
+/**/
+
+}
+
+
+
+// =================================================================================================
+//	___________ _____  _____              __          
+//	\_   _____// ____\/ ____\____   _____/  |_  ______
+//	 |    __)_\   __\\   __\/ __ \_/ ___\   __\/  ___/
+//	 |        \|  |   |  | \  ___/\  \___|  |  \___ \ 
+//	/_______  /|__|   |__|  \___  >\___  >__| /____  >
+//	        \/                  \/     \/          \/ 
+// =================================================================================================
+// The effects in this section are adapted from the Adafruit NeoPixel library at:
+// https://github.com/adafruit/Adafruit_NeoPixel/blob/master/examples/strandtest/strandtest.ino
+//
+// There, each effect is a loop that sets some pixels, calls show(), sleeps, and goes round again,
+// so only one can run at a time, and nothing else can happen until it's done. Here, each one is an
+// Effect_t instead: a little state machine that draws on its own stretch of pixels (its canvas).
+// stepEffect() works out from the time how many ticks it's due, and has it draw where it should
+// be by now. One render loop (runEffects()) steps any number of effects, and calls show() once per
+// frame for all of them. Nothing sleeps except show().
+//
+// The old functions (colorWipe() and so on) are still here. They run one effect to the end.
+
+// Input a value 0 to 255 to get a color value.
+// The colours are a transition r - g - b - back to r.
+Color_t Wheel(uint8_t WheelPos) {
+	if(WheelPos < 85) {
+		return Color(WheelPos * 3, 255 - WheelPos * 3, 0);
+	} else if(WheelPos < 170) {
+		WheelPos -= 85;
+		return Color(255 - WheelPos * 3, 0, WheelPos * 3);
+	} else {
+		WheelPos -= 170;
+		return Color(0, WheelPos * 3, 255 - WheelPos * 3);
+	}
+}
+
+// Color kernels
+// --------------------------------------------------------------------------------------------------
+// Working out a rainbow one pixel at a time through Wheel() and setPixelColorT() costs a function
+// call, a bounds check and three branches per pixel. These fill a whole run of pixels in one go,
+// with integer math and no branches in the loops (the compiler turns the ?:s into selects), so
+// they unroll and, at -O3, vectorize where the target is up to it: NEON can store 3-byte pixels
+// directly (vst3). Plain SSE2 isn't, for the hue kernels, but they're still a lot quicker.
+//
+// Hues are 32-bit fractions of a turn: 0x40000000 is a quarter of the way round, and they wrap
+// around by themselves. For the Wheel() kernel, the top 8 bits are the wheel position. A ramp
+// starts at one hue and moves on by step for each pixel, so it can go round by less than one
+// wheel position per pixel, or by exactly once along any number of pixels (see hueStep()).
+
+// The step that takes a ramp once round the wheel in count pixels
+uint32_t hueStep(unsigned int count) {
+	if(count == 0) {
+		return 0;
+	}
+	// Rounded up, so that pixel i lands on wheel position i * 256 / count, the same as it used to
+	// (exactly, on anything shorter than 4096 pixels)
+	return (uint32_t)((0x100000000ULL + count - 1) / count);
+}
+
+// Wheel(), for count pixels, starting at hue and moving on step for each pixel
+static void wheelKernel(Color_t *dest, unsigned int count, uint32_t hue, uint32_t step) {
+	unsigned int i, pos, sector, up;
+
+	for(i = 0; i < count; i++) {
+		pos = (hue + i * step) >> 24;
+		sector = (pos >= 85) + (pos >= 170);
+		up = (pos - sector * 85) * 3;
+		dest[i].r = sector == 0 ? up : sector == 1 ? 255 - up : 0;
+		dest[i].g = sector == 0 ? 255 - up : sector == 1 ? 0 : up;
+		dest[i].b = sector == 0 ? 0 : sector == 1 ? up : 255 - up;
+	}
+}
+
+// HSV to RGB, for count pixels, starting at hue and moving on step for each pixel. Saturation and
+// value (brightness) are 0-255. Red is at hue 0, green a third of the way round, and blue two
+// thirds, the same as Wheel(), but with all three channels at full tilt in between.
+static void hsvKernel(Color_t *dest, unsigned int count, uint32_t hue, uint32_t step, uint8_t s, uint8_t v) {
+	unsigned int i, h, sector, frac, p, q, t;
+
+	// Full saturation = nothing of the weakest channel
+	p = (v * (256 - s)) >> 8;
+	for(i = 0; i < count; i++) {
+		// Which sixth of the way round we are (sector), and how far through it (frac, 16 bits)
+		h = ((hue + i * step) >> 16) * 6;
+		sector = h >> 16;
+		frac = h & 0xffff;
+
+		// The channel on its way down (q), and the one on its way up (t)
+		q = (v * (65536 - ((s * frac) >> 8))) >> 16;
+		t = (v * (65536 - ((s * (65535 - frac)) >> 8))) >> 16;
+		dest[i].r = sector == 1 ? q : sector == 4 ? t : (sector == 2) | (sector == 3) ? p : v;
+		dest[i].g = sector == 0 ? t : sector == 3 ? q : sector >= 3 ? p : v;
+		dest[i].b = sector == 2 ? t : sector == 5 ? q : sector < 2 ? p : v;
+	}
+}
+
+// A straight line from one color to another: channel c of pixel i is start[c] + i * delta[c], in
+// 16.16 fixed point.
+static void gradientKernel(Color_t *dest, unsigned int count, const int32_t *start, const int32_t *delta) {
+	unsigned int i;
+
+	for(i = 0; i < count; i++) {
+		dest[i].r = (start[0] + (int32_t)i * delta[0]) >> 16;
+		dest[i].g = (start[1] + (int32_t)i * delta[1]) >> 16;
+		dest[i].b = (start[2] + (int32_t)i * delta[2]) >> 16;
+	}
+}
+
+// Dim count pixels to level (0-256, where 256 leaves them alone). Pixels are just bytes here.
+static void scaleKernel(Color_t *dest, unsigned int count, unsigned int level) {
+	uint8_t *bytes = (uint8_t *)dest;
+	unsigned int i;
+
+	for(i = 0; i < count * 3; i++) {
+		bytes[i] = (bytes[i] * level) >> 8;
+	}
+}
+
+// Set up gradientKernel() to go from one color to another in count pixels, with both ends exact
+static void gradientSetup(Color_t from, Color_t to, unsigned int count, int32_t *start, int32_t *delta) {
+	int from3[3] = { from.r, from.g, from.b };
+	int to3[3] = { to.r, to.g, to.b };
+	int c;
+
+	for(c = 0; c < 3; c++) {
+		start[c] = (from3[c] << 16) + 0x8000;	// Round to the nearest
+		delta[c] = count > 1 ? (to3[c] - from3[c]) * 65536 / (int)(count - 1) : 0;
+	}
+}
+
+// Ramp filling: the kernels above, on a range of LEDBuffer, shared between the worker threads
+typedef struct {
+	Color_t *dest;
+	uint32_t hue, step;			// fillWheel(), fillHSV()
+	uint8_t s, v;
+	int32_t start[3], delta[3];	// fillGradient()
+} Ramp_t;
+
+static void wheelSlice(void *arg, unsigned int first, unsigned int end) {
+	Ramp_t *ramp = arg;
+	wheelKernel(ramp->dest + first, end - first, ramp->hue + first * ramp->step, ramp->step);
+}
+
+static void hsvSlice(void *arg, unsigned int first, unsigned int end) {
+	Ramp_t *ramp = arg;
+	hsvKernel(ramp->dest + first, end - first, ramp->hue + first * ramp->step, ramp->step, ramp->s, ramp->v);
+}
+
+static void gradientSlice(void *arg, unsigned int first, unsigned int end) {
+	Ramp_t *ramp = arg;
+	int32_t start[3];
+	int c;
+
+	for(c = 0; c < 3; c++) {
+		start[c] = ramp->start[c] + (int32_t)first * ramp->delta[c];
+	}
+	gradientKernel(ramp->dest + first, end - first, start, ramp->delta);
+}
+
+// Fill pixels [first, first+count) with Wheel() colors, starting at hue and moving on step for each
+// pixel. fillWheel(0, numPixels(), 0, hueStep(numPixels())) is one rainbow along the whole chain.
+PixelError_t fillWheel(unsigned int first, unsigned int count, uint32_t hue, uint32_t step) {
+	Ramp_t ramp = { .dest = LEDBuffer + first, .hue = hue, .step = step };
+
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	runParallel(wheelSlice, &ramp, 0, count);
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+// The same, in HSV, with saturation s and value v (0-255)
+PixelError_t fillHSV(unsigned int first, unsigned int count, uint32_t hue, uint32_t step, uint8_t s, uint8_t v) {
+	Ramp_t ramp = { .dest = LEDBuffer + first, .hue = hue, .step = step, .s = s, .v = v };
+
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	runParallel(hsvSlice, &ramp, 0, count);
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+// Draw the first count pixels of a gradient that goes from one color to the other in length pixels
+static void gradientRun(Color_t *dest, unsigned int count, Color_t from, Color_t to, unsigned int length) {
+	Ramp_t ramp = { .dest = dest };
+
+	gradientSetup(from, to, length, ramp.start, ramp.delta);
+	runParallel(gradientSlice, &ramp, 0, count);
+}
+
+// Fill pixels [first, first+count) with a gradient: the first is from, the last is to
+PixelError_t fillGradient(unsigned int first, unsigned int count, Color_t from, Color_t to) {
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	gradientRun(LEDBuffer + first, count, from, to, count);
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+// A gradient through numStops colors, spaced out evenly: the first is on pixel first, and the last
+// on the last pixel
+PixelError_t fillGradientStops(unsigned int first, unsigned int count, const Color_t *stops, unsigned int numStops) {
+	unsigned int s, at, next;
+
+	if(stops == NULL || numStops < 2) {
+		return PIXEL_BAD_ARGUMENT;
+	}
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(count == 0) {
+		return PIXEL_OK;
+	}
+	// Each pair of stops gets its own straight line, up to (but not including) the next stop's
+	// pixel. The last one includes it.
+	for(s = 0; s < numStops - 1; s++) {
+		at = (unsigned long long)(count - 1) * s / (numStops - 1);
+		next = (unsigned long long)(count - 1) * (s + 1) / (numStops - 1);
+		gradientRun(LEDBuffer + first + at, next - at + (s == numStops - 2), stops[s], stops[s + 1], next - at + 1);
+	}
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+// Blending
+// --------------------------------------------------------------------------------------------------
+// Mixing two frames, a and b, into dest. Alpha says how much of b: 0 is all a, BLEND_ALPHA_MAX is
+// all b. Everything is integer math on bytes, so at -O3 the loops vectorize (even on plain SSE2),
+// and a crossfade of a 1000 pixel strip takes a few microseconds.
+//
+// With gamma correction on, the values in LEDBuffer aren't how much light the LEDs give out, so
+// halfway between red and black isn't half as bright as red: it's a good deal darker. So then
+// (unless you turn linearBlending off) the bytes go through a table into 16-bit light levels,
+// are mixed there, and go back through another table. The way back only has 4096 entries, but
+// that's still 16 times finer than the 256 levels the strip can show, after its own gamma table.
+#define BLEND_ALPHA_MAX		65536
+#define BLEND_CHUNK			256				// Bytes per pass through the light level tables
+
+typedef enum {
+	BLEND_CROSSFADE,		// a, turning into b
+	BLEND_ADD,				// a, plus alpha times b (as far as full brightness)
+	BLEND_MULTIPLY,			// a, turning into a times b (b as a filter: white lets everything through)
+} BlendMode_t;
+
+unsigned char linearBlending = true;		// Blend light levels rather than values, when there's gamma correction
+
+static uint16_t lightLUT[256];				// Value -> light level (0-65535)
+static uint8_t valueLUT[4096];				// Light level / 16 -> value
+static float lightLUTGamma;					// The gamma the tables are for (0 = not built yet)
+
+static void buildLightLUT() {
+	int i;
+
+	for(i = 0; i < 256; i++) {
+		lightLUT[i] = (uint16_t)(65535.0 * powf(i / 255.0, colorGamma) + 0.5);
+	}
+	for(i = 0; i < 4096; i++) {
+		valueLUT[i] = (uint8_t)(255.0 * powf((i * 16 + 8) / 65535.0, 1.0 / colorGamma) + 0.5);
+	}
+	// The ends have to come back exactly
+	valueLUT[0] = 0;
+	valueLUT[4095] = 255;
+	lightLUTGamma = colorGamma;
+}
+
+// Blend in light levels? (Builds the tables the first time, and again if gamma has changed.)
+static unsigned char blendLinear() {
+	if(!linearBlending || colorGamma == 1.0) {
+		return false;
+	}
+	if(lightLUTGamma != colorGamma) {
+		buildLightLUT();
+	}
+	return true;
+}
+
+// Blend count bytes, as they are. a8 is alpha in 8 bits (0-256).
+static void blendBytes(uint8_t *dest, const uint8_t *a, const uint8_t *b, unsigned int count, BlendMode_t mode, unsigned int a8) {
+	unsigned int i, sum;
+
+	switch(mode) {
+		case BLEND_CROSSFADE:
+			for(i = 0; i < count; i++) {
+				dest[i] = (a[i] * (256 - a8) + b[i] * a8) >> 8;
+			}
+			break;
+		case BLEND_ADD:
+			for(i = 0; i < count; i++) {
+				sum = a[i] + ((b[i] * a8) >> 8);
+				dest[i] = sum > 255 ? 255 : sum;
+			}
+			break;
+		case BLEND_MULTIPLY:
+			for(i = 0; i < count; i++) {
+				dest[i] = (a[i] * (256 - a8) + ((a[i] * (b[i] + 1)) >> 8) * a8) >> 8;
+			}
+			break;
+	}
+}
+
+// The same, in light levels. Alpha is 16 bits (0-65536) here: at the dark end, a step of 1/256
+// of the light could be bigger than a step on the strip.
+static void blendLight(uint8_t *dest, const uint8_t *a, const uint8_t *b, unsigned int count, BlendMode_t mode, unsigned int alpha) {
+	uint32_t la[BLEND_CHUNK], lb[BLEND_CHUNK];
+	unsigned int i, n;
+
+	for(; count; dest += n, a += n, b += n, count -= n) {
+		n = count < BLEND_CHUNK ? count : BLEND_CHUNK;
+		for(i = 0; i < n; i++) {
+			la[i] = lightLUT[a[i]];
+			lb[i] = lightLUT[b[i]];
+		}
+		switch(mode) {
+			case BLEND_CROSSFADE:
+				for(i = 0; i < n; i++) {
+					la[i] = (la[i] * (BLEND_ALPHA_MAX - alpha) + lb[i] * alpha) >> 16;
+				}
+				break;
+			case BLEND_ADD:
+				for(i = 0; i < n; i++) {
+					la[i] += (lb[i] * alpha) >> 16;
+					la[i] = la[i] > 65535 ? 65535 : la[i];
+				}
+				break;
+			case BLEND_MULTIPLY:
+				for(i = 0; i < n; i++) {
+					la[i] = (la[i] * (BLEND_ALPHA_MAX - alpha) + ((la[i] * (lb[i] + 1)) >> 16) * alpha) >> 16;
+				}
+				break;
+		}
+		for(i = 0; i < n; i++) {
+			dest[i] = valueLUT[la[i] >> 4];
+		}
+	}
+}
+
+typedef struct {
+	Color_t *dest;
+	const Color_t *a, *b;
+	BlendMode_t mode;
+	unsigned int alpha;
+	unsigned char linear;
+} Blend_t;
+
+static void blendSlice(void *arg, unsigned int first, unsigned int end) {
+	Blend_t *blend = arg;
+	uint8_t *dest = (uint8_t *)(blend->dest + first);
+	const uint8_t *a = (const uint8_t *)(blend->a + first);
+	const uint8_t *b = (const uint8_t *)(blend->b + first);
+
+	if(blend->linear) {
+		blendLight(dest, a, b, (end - first) * 3, blend->mode, blend->alpha);
+	} else {
+		blendBytes(dest, a, b, (end - first) * 3, blend->mode, (blend->alpha + 128) >> 8);
+	}
+}
+
+// Blend count pixels of frames a and b into dest. dest can be a or b.
+void blendFrames(Color_t *dest, const Color_t *a, const Color_t *b, unsigned int count, BlendMode_t mode, unsigned int alpha) {
+	Blend_t blend = { dest, a, b, mode, alpha > BLEND_ALPHA_MAX ? BLEND_ALPHA_MAX : alpha, blendLinear() };
+
+	// Nothing to mix? (The light level tables are close, but not exact, in between.)
+	if(mode == BLEND_CROSSFADE && (blend.alpha == 0 || blend.alpha == BLEND_ALPHA_MAX)) {
+		memmove(dest, blend.alpha ? b : a, count * sizeof(Color_t));
+		return;
+	}
+	if(mode != BLEND_CROSSFADE && blend.alpha == 0) {
+		memmove(dest, a, count * sizeof(Color_t));
+		return;
+	}
+	runParallel(blendSlice, &blend, 0, count);
+}
+
+// The same, into pixels [first, first+count) of the LED buffer. a and b are count pixels each
+// (either can be LEDBuffer + first, to blend with what's there already).
+PixelError_t blendPixels(unsigned int first, unsigned int count, const Color_t *a, const Color_t *b, BlendMode_t mode, unsigned int alpha) {
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(a == NULL || b == NULL || mode > BLEND_MULTIPLY) {
+		return PIXEL_BAD_ARGUMENT;
+	}
+	blendFrames(LEDBuffer + first, a, b, count, mode, alpha);
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+// Crossfade just one color
+Color_t blendColor(Color_t a, Color_t b, unsigned int alpha) {
+	Color_t c;
+
+	blendFrames(&c, &a, &b, 1, BLEND_CROSSFADE, alpha);
+	return c;
+}
+
+static void fadeSlice(void *arg, unsigned int first, unsigned int end) {
+	Blend_t *blend = arg;
+	uint8_t *dest = (uint8_t *)(blend->dest + first);
+	unsigned int i, count = (end - first) * 3;
+
+	if(blend->linear) {
+		for(i = 0; i < count; i++) {
+			dest[i] = valueLUT[(lightLUT[dest[i]] * blend->alpha) >> 20];
+		}
+	} else {
+		scaleKernel(blend->dest + first, end - first, (blend->alpha + 128) >> 8);
+	}
+}
+
+// Fade pixels [first, first+count) towards black, keeping level (0-256) of their light. Do it to a
+// canvas every frame before drawing on it, and whatever moves leaves a trail behind it.
+PixelError_t fadePixels(unsigned int first, unsigned int count, unsigned int level) {
+	Blend_t blend = { LEDBuffer, 0, 0, BLEND_CROSSFADE, (level > 256 ? 256 : level) << 8, blendLinear() };
+
+	if(checkPixelRange(first, count) != PIXEL_OK) {
+		return PIXEL_OUT_OF_RANGE;
+	}
+	if(level >= 256) {
+		return PIXEL_OK;
+	}
+	runParallel(fadeSlice, &blend, first, first + count);
+	markPixelsDirty(first, count);
+	return PIXEL_OK;
+}
+
+// Effect engine
+// --------------------------------------------------------------------------------------------------
+typedef struct Effect_s Effect_t;
+
+typedef struct {
+	char *name;
+	void (*init)(Effect_t *effect);						// Optional. Called by startEffect().
+	unsigned char (*step)(Effect_t *effect, unsigned int ticks);	// Move on ticks ticks (0 the first
+														// time), and draw. Returns false when that
+														// was the last one.
+} EffectType_t;
+
+struct Effect_s {
+	const EffectType_t *type;
+	unsigned int first;				// The effect draws on pixels [first, first+count)
+	unsigned int count;
+	Color_t color;					// For the effects that take one
+	unsigned long long periodNs;	// Time per tick
+	unsigned long long nextNs;		// When the next tick is due (0 = hasn't started yet)
+	unsigned int tick;				// Where it's got to
+	unsigned char done;
+	unsigned int level;				// Brightness, 0-256 (see effectPixel())
+
+	// Some effects need to remember more than that
+	int lastPhase;					// Theater chases: which pixels are lit
+	Color_t from, to;				// colorFade: what we're fading between
+};
+
+// Set up an effect to draw on count pixels, starting at first, one tick every periodNs. It starts
+// with the next stepEffect().
+void startEffect(Effect_t *effect, const EffectType_t *type, unsigned int first, unsigned int count,
+		Color_t color, unsigned long long periodNs) {
+	memset(effect, 0, sizeof(Effect_t));
+	effect->type = type;
+	effect->first = first;
+	effect->count = count;
+	effect->color = color;
+	effect->periodNs = periodNs;
+	effect->lastPhase = -1;
+	effect->level = 256;
+	if(type->init) {
+		type->init(effect);
+	}
+}
+
+// Dim a color to an effect's brightness
+static inline Color_t effectLevel(Effect_t *effect, Color_t c) {
+	if(effect->level < 256) {
+		c.r = (c.r * effect->level) >> 8;
+		c.g = (c.g * effect->level) >> 8;
+		c.b = (c.b * effect->level) >> 8;
+	}
+	return c;
+}
+
+// Effects draw pixel i of their canvas through this, so each one can have its own brightness (on
+// top of setBrightness(), which goes for everything)
+static inline void effectPixel(Effect_t *effect, unsigned int i, Color_t c) {
+	setPixelColorT(effect->first + i, effectLevel(effect, c));
+}
+
+// Effects that work out every pixel of their canvas in one go can have the worker threads share it
+// (see runParallel()). fill() draws canvas pixels [first, end) at dest, which is straight into
+// LEDBuffer, and the whole canvas is marked dirty at the end.
+typedef void (*EffectFillFunction_t)(Effect_t *effect, Color_t *dest, unsigned int first, unsigned int end);
+
+typedef struct {
+	Effect_t *effect;
+	EffectFillFunction_t fill;
+} EffectFill_t;
+
+static void effectFillSlice(void *arg, unsigned int first, unsigned int end) {
+	EffectFill_t *fill = arg;
+	Color_t *dest = LEDBuffer + fill->effect->first + first;
+
+	fill->fill(fill->effect, dest, first, end);
+	if(fill->effect->level < 256) {
+		scaleKernel(dest, end - first, fill->effect->level);
+	}
+}
+
+static void effectFill(Effect_t *effect, EffectFillFunction_t fill) {
+	EffectFill_t job = { effect, fill };
+
+	runParallel(effectFillSlice, &job, 0, effect->count);
+	markPixelsDirty(effect->first, effect->count);
+}
+
+// Bring an effect up to date. Returns false once it's finished.
+unsigned char stepEffect(Effect_t *effect, unsigned long long now) {
+	unsigned int ticks;
+
+	if(effect->done) {
+		return false;
+	}
+	if(effect->nextNs == 0) {
+		// First time: draw tick 0
+		ticks = 0;
+		effect->nextNs = now + effect->periodNs;
+	} else if(now < effect->nextNs) {
+		return true;
+	} else if(effect->periodNs == 0) {
+		ticks = 1;
+	} else {
+		// If we're behind (say the strip is too long to keep up), skip ahead rather than slow down
+		ticks = 1 + (now - effect->nextNs) / effect->periodNs;
+		effect->nextNs += ticks * effect->periodNs;
+	}
+	effect->done = !effect->type->step(effect, ticks);
+	return !effect->done;
+}
+
+// Render loop: step all the effects, show() the result, and go again until they've all finished.
+// Frames go out as often as the quickest effect ticks (or as often as the wire allows, if that's
+// less often).
+void runEffects(Effect_t *effects, unsigned int count) {
+	unsigned long long now, period;
+	unsigned int i, running;
+
+	do {
+		now = nowNs();
+		running = 0;
+		period = 0;
+		for(i = 0; i < count; i++) {
+			if(stepEffect(&effects[i], now)) {
+				running++;
+				if(period == 0 || effects[i].periodNs < period) {
+					period = effects[i].periodNs;
+				}
+			}
+		}
+		if(running && period != framePeriodNs) {
+			setFramePeriod(period);
+		}
+		show();
+	} while(running);
+}
+
+// Run just one effect on the whole strip. That's what the old blocking functions do.
+static void runEffect(const EffectType_t *type, Color_t color, unsigned long long periodNs) {
+	Effect_t effect;
+
+	startEffect(&effect, type, 0, numPixels(), color, periodNs);
+	runEffects(&effect, 1);
+}
+
+// Effects
+// --------------------------------------------------------------------------------------------------
+
+// Fill the dots one after the other with a color. (Every step draws all the pixels lit so far -
+// the unchanged ones cost next to nothing - so that it can be redrawn at a new brightness.)
+static unsigned char colorWipeStep(Effect_t *effect, unsigned int ticks) {
+	unsigned int i;
+
+	if(effect->count == 0) {
+		return false;
+	}
+	effect->tick += ticks;
+	if(effect->tick > effect->count - 1) {
+		effect->tick = effect->count - 1;
+	}
+	for(i = 0; i <= effect->tick; i++) {
+		effectPixel(effect, i, effect->color);
+	}
+	return effect->tick < effect->count - 1;
+}
+
+// Rainbow: pixel i is Wheel(i + tick)
+static void rainbowFill(Effect_t *effect, Color_t *dest, unsigned int first, unsigned int end) {
+	wheelKernel(dest, end - first, (first + effect->tick) << 24, 1 << 24);
+}
+
+static unsigned char rainbowStep(Effect_t *effect, unsigned int ticks) {
+	effect->tick += ticks;
+	if(effect->tick > 255) {
+		effect->tick = 255;
+	}
+	effectFill(effect, rainbowFill);
+	return effect->tick < 255;
+}
+
+// Slightly different, this makes the rainbow equally distributed throughout (5 cycles of all
+// colors on wheel): pixel i is Wheel(i * 256 / count + tick)
+static void rainbowCycleFill(Effect_t *effect, Color_t *dest, unsigned int first, unsigned int end) {
+	uint32_t step = hueStep(effect->count);
+	wheelKernel(dest, end - first, first * step + (effect->tick << 24), step);
+}
+
+static unsigned char rainbowCycleStep(Effect_t *effect, unsigned int ticks) {
+	effect->tick += ticks;
+	if(effect->tick > 256 * 5 - 1) {
+		effect->tick = 256 * 5 - 1;
+	}
+	effectFill(effect, rainbowCycleFill);
+	return effect->tick < 256 * 5 - 1;
+}
+
+// Theatre-style crawling lights: every third pixel on, moving along one each tick. Each chase turns
+// off the pixels it lit last time, and lights the next lot with color(i).
+static void theaterChaseDraw(Effect_t *effect, int phase, Color_t (*color)(Effect_t *effect, unsigned int i)) {
+	unsigned int i;
+
+	if(effect->lastPhase >= 0) {
+		for(i = effect->lastPhase; i < effect->count; i += 3) {
+			effectPixel(effect, i, Color(0, 0, 0));
+		}
+	}
+	for(i = phase; i < effect->count; i += 3) {
+		effectPixel(effect, i, color(effect, i));
+	}
+	effect->lastPhase = phase;
+}
+
+static Color_t theaterChaseColor(Effect_t *effect, unsigned int i) {
+	return effect->color;
+}
+
+static unsigned char theaterChaseStep(Effect_t *effect, unsigned int ticks) {
+	effect->tick += ticks;
+	if(effect->tick > 15 * 3 - 1) {		// 15 cycles of chasing
+		effect->tick = 15 * 3 - 1;
+	}
+	theaterChaseDraw(effect, effect->tick % 3, theaterChaseColor);
+	return effect->tick < 15 * 3 - 1;
+}
+
+// Theatre-style crawling lights with rainbow effect (cycling through every 4th color on the wheel)
+static Color_t theaterChaseRainbowColor(Effect_t *effect, unsigned int i) {
+	return Wheel((i + (effect->tick / 3) * 4) % 255);
+}
+
+static unsigned char theaterChaseRainbowStep(Effect_t *effect, unsigned int ticks) {
+	effect->tick += ticks;
+	if(effect->tick > 64 * 3 - 1) {
+		effect->tick = 64 * 3 - 1;
+	}
+	theaterChaseDraw(effect, effect->tick % 3, theaterChaseRainbowColor);
+	return effect->tick < 64 * 3 - 1;
+}
+
+// Watermelon fade :) Fades up to half brightness and back down. It dims its own colors rather than
+// calling setBrightness(), so it doesn't dim anything else that's running.
+static unsigned char watermelonStep(Effect_t *effect, unsigned int ticks) {
+	unsigned int i, level;
+
+	effect->tick += ticks;
+	if(effect->tick > 100) {
+		effect->tick = 100;
+	}
+	level = (effect->tick <= 50 ? effect->tick : 100 - effect->tick) * 256 / 100;
+	for(i = 0; i < effect->count; i++) {
+		effectPixel(effect, i, Color(((i * 5) & 255) * level >> 8, 64 * level >> 8, ((i * 2) & 255) * level >> 8));
+	}
+	return effect->tick < 100;
+}
+
+// Random color fade: 15 fades of 100 ticks each, from one color to the next. (Green doesn't fade.
+// It ramps up along the strip.)
+static void colorFadeTarget(Effect_t *effect, unsigned int fade) {
+	effect->from = effect->to;
+	if(fade % 3) {
+		effect->to = Color(120, 64, 48);
+	} else if(fade % 7) {
+		effect->to = Color(255, 255, 255);
+	} else {
+		effect->to = Color(rand(), rand(), rand());
+	}
+}
+
+static void colorFadeInit(Effect_t *effect) {
+	effect->to = Color(0, 0, 0);
+	colorFadeTarget(effect, 1);
+}
+
+static unsigned char colorFadeStep(Effect_t *effect, unsigned int ticks) {
+	unsigned int i;
+	Color_t c;
+
+	for(; ticks; ticks--) {
+		if(effect->tick == 15 * 100 - 1) {
+			break;
+		}
+		effect->tick++;
+		if(effect->tick % 100 == 0) {
+			colorFadeTarget(effect, effect->tick / 100 + 1);
+		}
+	}
+	c = blendColor(effect->from, effect->to, (effect->tick % 100) * BLEND_ALPHA_MAX / 100);
+	for(i = 0; i < effect->count; i++) {
+		effectPixel(effect, i, Color(c.r, i * (255 / effect->count), c.b));
+	}
+	return effect->tick < 15 * 100 - 1;
+}
+
+// A comet in the effect's color, flying along the canvas with its tail fading out behind it
+#define COMET_TAIL_LEVEL	192		// How much of its light the tail keeps each tick (out of 256)
+#define COMET_TAIL_TICKS	32		// The tail's gone (near enough) after this many
+
+static unsigned char cometStep(Effect_t *effect, unsigned int ticks) {
+	// If we're behind, the tail only needs the last few ticks
+	if(ticks > COMET_TAIL_TICKS) {
+		effect->tick += ticks - COMET_TAIL_TICKS;
+		ticks = COMET_TAIL_TICKS;
+	}
+	for(; ticks; ticks--) {
+		effect->tick++;
+		fadePixels(effect->first, effect->count, COMET_TAIL_LEVEL);
+		if(effect->tick < effect->count) {
+			effectPixel(effect, effect->tick, effect->color);
+		}
+	}
+	if(effect->tick == 0) {
+		effectPixel(effect, 0, effect->color);
+	}
+	return effect->tick < effect->count + COMET_TAIL_TICKS;
+}
+
+// Just one color. Done as soon as it's drawn.
+static unsigned char solidStep(Effect_t *effect, unsigned int ticks) {
+	unsigned int i;
+
+	for(i = 0; i < effect->count; i++) {
+		effectPixel(effect, i, effect->color);
+	}
+	return false;
+}
+
+const EffectType_t solidEffect = { "solid", 0, solidStep };
+const EffectType_t colorWipeEffect = { "colorWipe", 0, colorWipeStep };
+const EffectType_t rainbowEffect = { "rainbow", 0, rainbowStep };
+const EffectType_t rainbowCycleEffect = { "rainbowCycle", 0, rainbowCycleStep };
+const EffectType_t theaterChaseEffect = { "theaterChase", 0, theaterChaseStep };
+const EffectType_t theaterChaseRainbowEffect = { "theaterChaseRainbow", 0, theaterChaseRainbowStep };
+const EffectType_t watermelonEffect = { "watermelon", 0, watermelonStep };
+const EffectType_t colorFadeEffect = { "colorFade", colorFadeInit, colorFadeStep };
+const EffectType_t cometEffect = { "comet", 0, cometStep };
+
+// All of them, for anything that wants to go through the lot (like the benchmarks)
+const EffectType_t *builtinEffects[] = {
+	&solidEffect, &colorWipeEffect, &rainbowEffect, &rainbowCycleEffect, &theaterChaseEffect,
+	&theaterChaseRainbowEffect, &watermelonEffect, &colorFadeEffect, &cometEffect, NULL
+};
+
+// The old way: run one effect on the whole strip, and return when it's done. wait is the time per
+// tick, in milliseconds.
+void colorWipe(Color_t c, uint8_t wait) {
+	runEffect(&colorWipeEffect, c, wait * 1000000ULL);
+}
+
+void rainbow(uint8_t wait) {
+	runEffect(&rainbowEffect, Color(0, 0, 0), wait * 1000000ULL);
+}
+
+void rainbowCycle(uint8_t wait) {
+	runEffect(&rainbowCycleEffect, Color(0, 0, 0), wait * 1000000ULL);
+}
+
+void theaterChase(Color_t c, uint8_t wait) {
+	runEffect(&theaterChaseEffect, c, wait * 1000000ULL);
+}
+
+void theaterChaseRainbow(uint8_t wait) {
+	runEffect(&theaterChaseRainbowEffect, Color(0, 0, 0), wait * 1000000ULL);
+}
+
+// Segments
+// --------------------------------------------------------------------------------------------------
+// An installation often splits one chain of pixels into lots of zones: letters on a sign, the edges
+// of shelves, and so on. Each segment is a stretch of the LED buffer with its own effect and its
+// own brightness. runSegments() steps them all, and each frame goes out with one show() - so fifty
+// zones cost one transfer, not fifty. Segments whose effects have nothing new to draw don't touch
+// their pixels, so show() only encodes the stretch of the chain that actually changed, in one go.
+//
+// Anything outside the segments is left alone, so you can still set those pixels yourself.
+
+#define MAX_SEGMENTS		64
+
+typedef struct {
+	unsigned int first;				// Pixels [first, first+count) belong to this segment
+	unsigned int count;
+	Effect_t effect;				// What's drawing on it (effect.type is 0 if nothing is)
+} Segment_t;
+
+Segment_t segments[MAX_SEGMENTS];
+unsigned int numSegments;
+
+// Forget all the segments (their pixels stay as they are)
+void clearSegments() {
+	numSegments = 0;
+}
+
+// Make pixels [first, first+count) a segment. Returns its number, or -1 if it doesn't fit on the
+// strip, overlaps another segment, or there are too many.
+int addSegment(unsigned int first, unsigned int count) {
+	unsigned int i;
+
+	if(count == 0 || first >= numLEDs || count > numLEDs - first) {
+		printf("Unable to add segment %u-%u (LED buffer is %d pixels long)\n", first, first + count - 1, numLEDs);
+		return -1;
+	}
+	for(i = 0; i < numSegments; i++) {
+		if(first < segments[i].first + segments[i].count && segments[i].first < first + count) {
+			printf("Unable to add segment %u-%u (it overlaps segment %u)\n", first, first + count - 1, i);
+			return -1;
+		}
+	}
+	if(numSegments == MAX_SEGMENTS) {
+		printf("Unable to add segment %u-%u (there can only be %d)\n", first, first + count - 1, MAX_SEGMENTS);
+		return -1;
+	}
+	memset(&segments[numSegments], 0, sizeof(Segment_t));
+	segments[numSegments].first = first;
+	segments[numSegments].count = count;
+	segments[numSegments].effect.level = 256;
+	return numSegments++;
+}
+
+static unsigned char validSegment(int segment) {
+	if(segment < 0 || segment >= numSegments) {
+		printf("There's no segment %d\n", segment);
+		return false;
+	}
+	return true;
+}
+
+// Start an effect on a segment, in place of whatever was there. It keeps the segment's brightness.
+unsigned char setSegmentEffect(int segment, const EffectType_t *type, Color_t color, unsigned long long periodNs) {
+	Segment_t *seg;
+	unsigned int level;
+
+	if(!validSegment(segment)) {
+		return false;
+	}
+	seg = &segments[segment];
+	level = seg->effect.level;
+	startEffect(&seg->effect, type, seg->first, seg->count, color, periodNs);
+	seg->effect.level = level;
+	return true;
+}
+
+// Fill a segment with one color
+unsigned char setSegmentColor(int segment, Color_t color) {
+	return setSegmentEffect(segment, &solidEffect, color, 0);
+}
+
+// Set a segment's brightness (0-1). What it's showing is redrawn to match.
+unsigned char setSegmentBrightness(int segment, float b) {
+	Effect_t *effect;
+
+	if(!validSegment(segment)) {
+		return false;
+	}
+	if(b < 0 || b > 1) {
+		printf("Segment brightness has to be between 0 and 1.\n");
+		return false;
+	}
+	effect = &segments[segment].effect;
+	effect->level = b * 256 + 0.5;
+	if(effect->type && effect->nextNs) {
+		effect->type->step(effect, 0);
+	}
+	return true;
+}
+
+// Bring every segment up to date. Returns how many are still running, and the shortest tick
+// period among them in *period.
+unsigned int stepSegments(unsigned long long now, unsigned long long *period) {
+	unsigned int i, running = 0;
+
+	*period = 0;
+	for(i = 0; i < numSegments; i++) {
+		if(segments[i].effect.type && stepEffect(&segments[i].effect, now)) {
+			running++;
+			if(*period == 0 || segments[i].effect.periodNs < *period) {
+				*period = segments[i].effect.periodNs;
+			}
+		}
+	}
+	return running;
+}
+
+// Render loop for segments: step them, and show() each frame, until all their effects have finished
+void runSegments() {
+	unsigned long long period;
+	unsigned int running;
+
+	do {
+		running = stepSegments(nowNs(), &period);
+		if(running && period != framePeriodNs) {
+			setFramePeriod(period);
+		}
+		show();
+	} while(running);
+}
+
+
+
+
+// =================================================================================================
+//	________                                       
+//	\______ \ _____    ____   _____   ____   ____  
+//	 |    |  \\__  \ _/ __ \ /     \ /  _ \ /    |
+//	 |    `   \/ __ \\  ___/|  Y Y  (  <_> )   |  |
+//	/_______  (____  /\___  >__|_|  /\____/|___|  /
+//	        \/     \/     \/      \/            \/ 
+// =================================================================================================
+// Like ServoBlaster, --daemon makes a named pipe (/dev/ws2812, unless you give it another path) and
+// takes commands from it, one per line. Then anything that can write to a file can drive the strip:
+//
+//		echo "fill 0 0 64" > /dev/ws2812; echo "set 3 255 0 0" > /dev/ws2812; echo show > /dev/ws2812
+//
+//		set <pixel> <r> <g> <b>				Set one pixel
+//		range <first> <last> <r> <g> <b>	Set pixels first through last (inclusive)
+//		fill <r> <g> <b>					Set every pixel
+//		clear								Turn every pixel off
+//		brightness <0-1>					Same as setBrightness()
+//		show								Send the pixels to the strip
+//
+// Numbers can be decimal or 0x hex. Blank lines, and lines starting with #, are ignored. A bad
+// command gets a complaint on the console, and then we carry on with the next one.
+//
+// Commands are handled in batches. Everything waiting in the pipe gets applied to the LED buffer,
+// and then (if the batch had a "show" in it anywhere) we call show() exactly once. So a script that
+// sets a thousand pixels, calling show after every one, doesn't pay for a thousand frames - it just
+// gets its pixels on the strip as fast as the strip can take them.
+
+#define DEFAULT_FIFO_PATH		"/dev/ws2812"
+#define DAEMON_LINE_MAX			1024			// Longest command we'll accept
+#define DAEMON_READ_SIZE		65536			// How much we try to read at once
+#define DAEMON_BATCH_MAX		(1024 * 1024)	// Show what we have after this many bytes, even if more is waiting
+
+static char *daemonPath;
+static unsigned long daemonBatches;				// Batches read from the pipe
+static unsigned long daemonCommands;			// Commands in them (not counting blanks and comments)
+static unsigned long daemonShows;				// Batches that called show()
+static unsigned long daemonErrors;				// Commands we couldn't make sense of
+
+// Read count numbers from s into values[]. Fails if there are too few, too many, or anything that
+// isn't a number.
+static unsigned char daemonNumbers(char *s, long *values, int count) {
+	char *end;
+	int i;
+
+	for(i = 0; i < count; i++) {
+		errno = 0;
+		values[i] = strtol(s, &end, 0);
+		if(end == s || errno) {
+			return false;
+		}
+		s = end;
+	}
+	while(*s == ' ' || *s == '\t' || *s == '\r') {
+		s++;
+	}
+	return *s == 0;
+}
+
+static unsigned char daemonColor(long *rgb) {
+	return rgb[0] >= 0 && rgb[0] <= 255 && rgb[1] >= 0 && rgb[1] <= 255 && rgb[2] >= 0 && rgb[2] <= 255;
+}
+
+// Apply one command to the LED buffer. Returns 1 if it asked for a show(), 0 if it didn't, and -1
+// if we couldn't make sense of it.
+static int daemonCommand(char *line) {
+	char *cmd, *args, *end;
+	long v[5];
+	float b;
+
+	while(*line == ' ' || *line == '\t') {
+		line++;
+	}
+	if(*line == 0 || *line == '\r' || *line == '#') {
+		return 0;
+	}
+	daemonCommands++;
+
+	// Split the command name from its arguments
+	cmd = line;
+	args = cmd + strcspn(cmd, " \t\r");
+	if(*args) {
+		*args++ = 0;
+	}
+
+	if(strcmp(cmd, "set") == 0) {
+		if(!daemonNumbers(args, v, 4) || !daemonColor(v + 1)) {
+			printf("Usage: set <pixel> <r> <g> <b>\n");
+			return -1;
+		}
+		if(v[0] < 0 || v[0] >= numLEDs) {
+			printf("Unable to set pixel %ld (LED buffer is %d pixels long)\n", v[0], numLEDs);
+			return -1;
+		}
+		setPixelColor(v[0], v[1], v[2], v[3]);
+	} else if(strcmp(cmd, "range") == 0) {
+		if(!daemonNumbers(args, v, 5) || !daemonColor(v + 2)) {
+			printf("Usage: range <first> <last> <r> <g> <b>\n");
+			return -1;
+		}
+		if(v[0] < 0 || v[0] > v[1] || v[1] >= numLEDs) {
+			printf("Unable to set pixels %ld-%ld (LED buffer is %d pixels long)\n", v[0], v[1], numLEDs);
+			return -1;
+		}
+		fillPixels(v[0], v[1] - v[0] + 1, Color(v[2], v[3], v[4]));
+	} else if(strcmp(cmd, "fill") == 0) {
+		if(!daemonNumbers(args, v, 3) || !daemonColor(v)) {
+			printf("Usage: fill <r> <g> <b>\n");
+			return -1;
+		}
+		fillPixels(0, numLEDs, Color(v[0], v[1], v[2]));
+	} else if(strcmp(cmd, "clear") == 0) {
+		if(!daemonNumbers(args, v, 0)) {
+			printf("Usage: clear\n");
+			return -1;
+		}
+		clearLEDBuffer();
+	} else if(strcmp(cmd, "brightness") == 0) {
+		b = strtof(args, &end);
+		if(end == args || !daemonNumbers(end, v, 0)) {
+			printf("Usage: brightness <0-1>\n");
+			return -1;
+		}
+		if(!setBrightness(b)) {
+			return -1;
+		}
+	} else if(strcmp(cmd, "show") == 0) {
+		if(!daemonNumbers(args, v, 0)) {
+			printf("Usage: show\n");
+			return -1;
+		}
+		return 1;
+	} else {
+		printf("Unknown command: %s\n", cmd);
+		return -1;
+	}
+	return 0;
+}
+
+static void stopDaemon() {
+	if(daemonPath) {
+		unlink(daemonPath);
+		daemonPath = 0;
+	}
+	if(simulate) {
+		printf("Daemon\n");
+		printf("	       Batches: %lu (%lu shown)\n", daemonBatches, daemonShows);
+		printf("	      Commands: %lu (%lu bad)\n", daemonCommands, daemonErrors);
+		printf("\n");
+	}
+}
+
+// Make the pipe, and then take commands from it until we're killed
+void runDaemon(char *path) {
+	static char buf[DAEMON_READ_SIZE + DAEMON_LINE_MAX];
+	struct pollfd pfd;
+	unsigned int used = 0, batchBytes;
+	unsigned char showWanted, discard = false;
+	char *start, *newline;
+	int fd, n, ready;
+
+	unlink(path);
+	if(mkfifo(path, 0666) < 0) {
+		fatal("Failed to create %s: %m\n", path);
+	}
+	chmod(path, 0666);			// In spite of the umask, anybody can write to it
+	daemonPath = path;
+	atexit(stopDaemon);
+
+	// We open our own pipe for writing too. Otherwise, each time the last writer closes it, we'd
+	// get an end of file, and have to open it again before anybody else could write.
+	fd = open(path, O_RDWR | O_NONBLOCK);
+	if(fd < 0) {
+		fatal("Failed to open %s: %m\n", path);
+	}
+	printf("Waiting for commands on %s\n", path);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for(;;) {
+		ready = poll(&pfd, 1, ditherRefreshWanted() ? 0 : -1);
+		if(ready < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fatal("Failed to poll %s: %m\n", path);
+		}
+		if(ready == 0) {
+			show();
+			continue;
+		}
+
+		// Drain the pipe (to a point - a writer who never stops shouldn't keep the strip dark), and
+		// apply every complete line. A partial line stays in buf until the rest of it turns up.
+		showWanted = false;
+		batchBytes = 0;
+		while(batchBytes < DAEMON_BATCH_MAX) {
+			n = read(fd, buf + used, DAEMON_READ_SIZE);
+			if(n <= 0) {
+				break;
+			}
+			used += n;
+			batchBytes += n;
+
+			start = buf;
+			while((newline = memchr(start, '\n', buf + used - start)) != NULL) {
+				*newline = 0;
+				if(discard) {
+					discard = false;		// The end of a line that was too long
+				} else if(newline - start > DAEMON_LINE_MAX) {
+					printf("Ignoring a command longer than %d characters\n", DAEMON_LINE_MAX);
+					daemonErrors++;
+				} else switch(daemonCommand(start)) {
+					case 1:
+						showWanted = true;
+						break;
+					case -1:
+						daemonErrors++;
+						break;
+				}
+				start = newline + 1;
+			}
+			used = buf + used - start;
+			memmove(buf, start, used);
+			if(used > DAEMON_LINE_MAX) {
+				if(!discard) {
+					printf("Ignoring a command longer than %d characters\n", DAEMON_LINE_MAX);
+					daemonErrors++;
+				}
+				discard = true;
+				used = 0;
+			}
+		}
+		daemonBatches++;
+
+		// One frame per batch, however many times it asked. Frames go out when we're told, not on a
+		// schedule.
+		if(showWanted) {
+			restartFrameSchedule();
+			show();
+			daemonShows++;
+		}
+	}
+}
+
+
+
+// Shared memory frame ring
+// --------------------------------------------------------------------------------------------------
+// With --shm, other processes hand us whole frames through shared memory instead (see ws2812-shm.h
+// for their end of it). Whenever the strip is ready for another frame, we copy the newest complete
+// one into LEDBuffer, and show() it. Anything newer than the frame on the wire, but older than the
+// newest, is never shown - the producer can run faster than the strip without falling behind.
+
+#define SHM_POLL_NS				500000			// How often we look for a new frame when there isn't one
+#define SHM_STRESS_FPS			500				// How fast --shm-stress's producer makes frames
+#define DEFAULT_STRESS_SECONDS	5
+
+static ws2812_shm_t *shm;
+static char *shmName;
+static uint32_t shmLastFrame;					// The frame we took last
+static unsigned long shmFrames;					// Frames we took
+static unsigned long shmSuperseded;				// Frames the producer published, but we never took
+static unsigned long shmRetries;				// Times the producer lapped us while we were reading a frame
+static unsigned long shmTorn;					// --shm-stress frames that weren't all from the same frame
+
+// Make the shared memory object and set up the ring. Once the magic number is in, clients can use it.
+static void createShm(char *name) {
+	size_t size = ws2812_shm_size(numLEDs);
+	int fd;
+
+	assert(sizeof(Color_t) == 3);				// Clients write pixels in LEDBuffer's format
+
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+	if(fd < 0) {
+		fatal("Failed to create shared memory %s: %m\n", name);
+	}
+	fchmod(fd, 0666);							// In spite of the umask, anybody can use it
+	if(ftruncate(fd, size) < 0) {
+		fatal("Failed to size shared memory %s: %m\n", name);
+	}
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED) {
+		shm = 0;
+		fatal("Failed to map shared memory %s: %m\n", name);
+	}
+	shmName = name;
+
+	// ftruncate() zeroed it, so latest and the sequence numbers are already 0 (no frames yet)
+	shm->version = WS2812_SHM_VERSION;
+	shm->numLEDs = numLEDs;
+	shm->frameBytes = ws2812_shm_frame_bytes(numLEDs);
+	__atomic_store_n(&shm->magic, WS2812_SHM_MAGIC, __ATOMIC_RELEASE);
+	shmLastFrame = 0;
+}
+
+static void stopShm() {
+	if(shmName) {
+		shm_unlink(shmName);
+		shmName = 0;
+	}
+	if(simulate) {
+		printf("Shared memory\n");
+		printf("	  Frames taken: %lu\n", shmFrames);
+		printf("	    Superseded: %lu\n", shmSuperseded);
+		printf("	       Retries: %lu\n", shmRetries);
+		printf("	   Torn frames: %lu\n", shmTorn);
+		printf("\n");
+	}
+}
+
+// Copy the newest complete frame into LEDBuffer. Returns false if there isn't a new one.
+static unsigned char shmTakeFrame() {
+	uint32_t frame, slot, seq;
+
+	for(;;) {
+		frame = __atomic_load_n(&shm->latest, __ATOMIC_ACQUIRE);
+		if(frame == shmLastFrame) {
+			return false;
+		}
+		slot = frame % WS2812_SHM_SLOTS;
+
+		// If the sequence number is the same after we've copied the pixels as it was before (and
+		// even), the producer didn't touch them meanwhile
+		seq = __atomic_load_n(&shm->sequence[slot], __ATOMIC_ACQUIRE);
+		if(seq == frame * 2) {
+			memcpy(LEDBuffer, ws2812_shm_slot(shm, slot), numLEDs * sizeof(Color_t));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&shm->sequence[slot], __ATOMIC_RELAXED) == seq) {
+				break;
+			}
+		}
+
+		// It came all the way round the ring while we weren't looking. There's a newer frame now.
+		shmRetries++;
+	}
+
+	shmSuperseded += frame - shmLastFrame - 1;
+	shmLastFrame = frame;
+	shmFrames++;
+	markPixelsDirty(0, numLEDs);
+	return true;
+}
+
+// The --shm-stress producer's pattern. Every pixel depends on the frame number, so we can tell if a
+// frame we took is a mix of two.
+static inline Color_t shmStressPixel(uint32_t frame, unsigned int i) {
+	return Color(frame + i, frame * 7 + i, frame >> 8);
+}
+
+static void shmCheckStressFrame() {
+	uint32_t frame = LEDBuffer[0].r | (LEDBuffer[0].b << 8);	// The low 16 bits are enough
+	Color_t c;
+	unsigned int i;
+
+	for(i = 0; i < numLEDs; i++) {
+		c = shmStressPixel(frame, i);
+		if(memcmp(&LEDBuffer[i], &c, sizeof(Color_t)) != 0) {
+			shmTorn++;
+			return;
+		}
+	}
+}
+
+// Another process, publishing frames through the client library as fast as a video player might.
+// Runs in the child after --shm-stress forks.
+static void shmStressProducer(char *name, int seconds) {
+	struct timespec deadline;
+	unsigned long long next, start, writeNs = 0;
+	unsigned long frames = 0;
+	ws2812_shm_t *client;
+	unsigned char *pixels;
+	Color_t c;
+	unsigned int i;
+
+	client = ws2812_shm_open(name);
+	if(client == NULL) {
+		fprintf(stderr, "Producer failed to open shared memory %s: %m\n", name);
+		_exit(EXIT_FAILURE);
+	}
+
+	next = nowNs();
+	for(frames = 0; frames < (unsigned long)seconds * SHM_STRESS_FPS; frames++) {
+		start = nowNs();
+		pixels = ws2812_shm_begin(client);
+		for(i = 0; i < client->numLEDs; i++) {
+			c = shmStressPixel(client->latest + 1, i);
+			memcpy(pixels + i * 3, &c, 3);
+		}
+		ws2812_shm_publish(client);
+		writeNs += nowNs() - start;
+
+		next += 1000000000ULL / SHM_STRESS_FPS;
+		deadline.tv_sec = next / 1000000000ULL;
+		deadline.tv_nsec = next % 1000000000ULL;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+	}
+
+	printf("Producer\n");
+	printf("	     Published: %lu frames at %d fps\n", frames, SHM_STRESS_FPS);
+	printf("	    Write time: %.2f us/frame (filling in the pixels, and publishing them)\n", writeNs / 1e3 / frames);
+	printf("\n");
+	ws2812_shm_close(client);
+	_exit(EXIT_SUCCESS);
+}
+
+// Make the ring, and then show frames from it until we're killed. With stressSeconds, fork a
+// producer that runs for that long, and return when it's done.
+void runShm(char *name, int stressSeconds) {
+	struct timespec poll = { 0, SHM_POLL_NS };
+	pid_t producer = 0;
+	int i, status;
+
+	createShm(name);
+	atexit(stopShm);
+
+	if(stressSeconds) {
+		signal(SIGCHLD, SIG_DFL);				// The producer finishing isn't a reason to die
+		producer = fork();
+		if(producer < 0) {
+			fatal("Failed to fork: %m\n");
+		}
+		if(producer == 0) {
+			// The child mustn't stop the DMA engine on its way out, so it gets the default handlers
+			for(i = 1; i < 64; i++) {
+				signal(i, SIG_DFL);
+			}
+			shmStressProducer(name, stressSeconds);
+		}
+	} else {
+		printf("Waiting for frames in shared memory %s\n", name);
+	}
+
+	for(;;) {
+		// Take the newest frame as soon as the strip can show it
+		ws2812_wait();
+		if(shmTakeFrame()) {
+			if(producer) {
+				shmCheckStressFrame();
+			}
+			restartFrameSchedule();
+			show();
+		} else {
+			if(producer && waitpid(producer, &status, WNOHANG) == producer) {
+				return;
+			}
+			if(ditherRefreshWanted()) {
+				show();
+			} else {
+				nanosleep(&poll, NULL);
+			}
+		}
+	}
+}
+
+
+
+// Open Pixel Control server
+// --------------------------------------------------------------------------------------------------
+// With --opc, we listen on TCP port 7890 (or whichever you say) for Open Pixel Control clients (see
+// http://openpixelcontrol.org). Each message is a 4 byte header - channel, command, and the length
+// of the data (big endian) - followed by the data. We only do command 0, "set pixel colors", whose
+// data is r, g, b for each pixel in turn. That's exactly how LEDBuffer is laid out, so a message is
+// one memcpy() into it. Channel 0 is the whole LED buffer, and channels 1 and 2 are the strips.
+//
+// Sockets don't block. Each client has its own buffer for the message it's partway through, and
+// the pixels only go into LEDBuffer once the whole message is here. So a client that stops halfway
+// (or hangs up) doesn't leave half a frame behind, and a slow one doesn't hold the others up.
+//
+// Clients can send frames faster than the strip can show them. We read everything that's waiting
+// before each show(), and each frame lands on top of the last, so the strip always gets the newest
+// one, and the ones in between are never encoded or sent. But clients that never stop sending
+// shouldn't keep the strip from updating, so once a frame has waited as long as one takes to send,
+// it goes out, whatever else is waiting.
+
+#define OPC_DEFAULT_PORT		7890
+#define OPC_MAX_CLIENTS			8
+#define OPC_HEADER_BYTES		4
+#define OPC_SET_PIXELS			0				// The only command we understand
+
+typedef struct {
+	int fd;
+	unsigned char header[OPC_HEADER_BYTES];
+	unsigned int have;							// Bytes of the current message so far, header included
+	unsigned int length;						// Data bytes in the current message
+	unsigned int keep;							// How many of them are pixels we want
+	Color_t *pixels;							// Where they go until the message is complete
+} OPCClient_t;
+
+static int opcListener = -1;
+static unsigned char opcPending;				// LEDBuffer has pixels the strip hasn't seen yet
+static unsigned long long opcDeadlineNs;		// ...and they go out by then, even if more is waiting
+static unsigned long opcClients;				// Connections accepted
+static unsigned long opcMessages;				// Set pixel colors messages received
+static unsigned long opcFrames;					// Times we called show() for them
+static unsigned long opcIgnored;				// Other commands, and channels we don't have
+
+static void stopOPC() {
+	if(opcListener >= 0) {
+		close(opcListener);
+		opcListener = -1;
+	}
+	if(simulate) {
+		printf("Open Pixel Control\n");
+		printf("	       Clients: %lu\n", opcClients);
+		printf("	      Messages: %lu (%lu ignored)\n", opcMessages, opcIgnored);
+		printf("	  Frames shown: %lu\n", opcFrames);
+		printf("\n");
+	}
+}
+
+// The message a client just finished: put its pixels in LEDBuffer
+static void opcApplyMessage(OPCClient_t *client) {
+	unsigned int channel = client->header[0];
+	unsigned int first = channel ? (channel - 1) * stripLength : 0;
+
+	if(client->header[1] != OPC_SET_PIXELS || channel > numStrips) {
+		opcIgnored++;
+		return;
+	}
+	memcpy(LEDBuffer + first, client->pixels, client->keep);
+	markPixelsDirty(first, (client->keep + sizeof(Color_t) - 1) / sizeof(Color_t));
+	if(!opcPending) {
+		opcDeadlineNs = nowNs() + minFramePeriodNs();
+	}
+	opcPending = true;
+	opcMessages++;
+}
+
+// Read what a client has sent us, up to the end of one message. Returns false if it hung up (or
+// something went wrong).
+static unsigned char opcRead(OPCClient_t *client) {
+	unsigned char scratch[4096];
+	unsigned int channel, room, offset;
+	int n;
+
+	for(;;) {
+		if(client->have < OPC_HEADER_BYTES) {
+			n = recv(client->fd, client->header + client->have, OPC_HEADER_BYTES - client->have, 0);
+		} else if((offset = client->have - OPC_HEADER_BYTES) < client->keep) {
+			n = recv(client->fd, (unsigned char *)client->pixels + offset, client->keep - offset, 0);
 		} else {
-			red = rand();
-			green = rand();
-			blue = rand();
-		}
-		for(k=0; k<1; k+=.01) {
-			for(i=0; i<numLEDs; i++) {
-				setPixelColor(
-					i,
-					(red * k) + (lastRed * (1-k)),
-					i * (255 / numLEDs), //(green * k) + (lastGreen * (1-k)),
-					(blue * k) + (lastBlue * (1-k))
-					);
-				curPixel = getPixelColor(i);
+			// Skip whatever we don't want: other commands, other channels, and pixels off the end
+			room = client->length - offset;
+			n = recv(client->fd, scratch, room < sizeof(scratch) ? room : sizeof(scratch), 0);
+		}
+		if(n == 0) {
+			return false;
+		}
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;		// That's all for now
+		}
+		client->have += n;
+
+		// Got the header: how much of the data do we want?
+		if(client->have == OPC_HEADER_BYTES) {
+			channel = client->header[0];
+			client->length = (client->header[2] << 8) | client->header[3];
+			client->keep = 0;
+			if(client->header[1] == OPC_SET_PIXELS && channel <= numStrips) {
+				room = (channel ? stripLength : numLEDs) * sizeof(Color_t);
+				client->keep = client->length < room ? client->length : room;
+			}
+		}
+
+		// Got the whole message
+		if(client->have >= OPC_HEADER_BYTES && client->have == OPC_HEADER_BYTES + client->length) {
+			opcApplyMessage(client);
+			client->have = 0;
+			return true;
+		}
+	}
+}
+
+// Listen for clients, and show what they send until we're killed
+void runOPC(int port) {
+	struct pollfd pfd[1 + OPC_MAX_CLIENTS];
+	OPCClient_t clients[1 + OPC_MAX_CLIENTS];		// clients[i] goes with pfd[i]
+	struct sockaddr_in addr;
+	int i, n, fd, ready, one = 1;
+
+	opcListener = socket(AF_INET, SOCK_STREAM, 0);
+	if(opcListener < 0) {
+		fatal("Failed to make a socket: %m\n");
+	}
+	setsockopt(opcListener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if(bind(opcListener, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fatal("Failed to listen on port %d: %m\n", port);
+	}
+	if(listen(opcListener, OPC_MAX_CLIENTS) < 0) {
+		fatal("Failed to listen on port %d: %m\n", port);
+	}
+	atexit(stopOPC);
+	printf("Waiting for Open Pixel Control clients on port %d\n", port);
+
+	pfd[0].fd = opcListener;
+	pfd[0].events = POLLIN;
+	n = 1;
+	for(;;) {
+		// If there's a frame waiting to go out, just look for anything newer. Otherwise, sleep
+		// until somebody sends us something.
+		ready = poll(pfd, n, opcPending || ditherRefreshWanted() ? 0 : -1);
+		if(ready < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fatal("Failed to poll: %m\n");
+		}
+
+		// Nothing new, so show what we have (or, when we're dithering, show it again). Same if a
+		// frame's been waiting too long, whatever's come in since.
+		if(ready == 0 || (opcPending && nowNs() >= opcDeadlineNs)) {
+			if(opcPending) {
+				restartFrameSchedule();
+				opcFrames++;
+				opcPending = false;
+			}
+			show();
+			if(ready == 0) {
+				continue;
+			}
+		}
+
+		// Up to one message from each client that has sent something. Hang-ups get the last
+		// client's slot.
+		for(i = n - 1; i >= 1; i--) {
+			if(pfd[i].revents && !opcRead(&clients[i])) {
+				close(pfd[i].fd);
+				free(clients[i].pixels);
+				n--;
+				pfd[i] = pfd[n];
+				clients[i] = clients[n];
+			}
+		}
+
+		if(pfd[0].revents & POLLIN) {
+			fd = accept(opcListener, NULL, NULL);
+			if(fd >= 0 && n == 1 + OPC_MAX_CLIENTS) {
+				printf("Too many Open Pixel Control clients (%d at most)\n", OPC_MAX_CLIENTS);
+				close(fd);
+			} else if(fd >= 0) {
+				memset(&clients[n], 0, sizeof(OPCClient_t));
+				clients[n].fd = fd;
+				clients[n].pixels = malloc(numLEDs * sizeof(Color_t));
+				if(!clients[n].pixels || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+					printf("Failed to set up Open Pixel Control client: %s\n", strerror(errno));
+					free(clients[n].pixels);
+					close(fd);
+					continue;
+				}
+				pfd[n].fd = fd;
+				pfd[n].events = POLLIN;
+				n++;
+				opcClients++;
+			}
+		}
+	}
+}
+
+
+
+// =================================================================================================
+//	   _____         .__        
+//	  /     \ _____  |__| ____  
+//	 /  \ /  \\__  \ |  |/    \ 
+//	/    Y    \/ __ \|  |   |  \
+//	\____|__  (____  /__|___|  /
+//	        \/     \/        \/ 
+// =================================================================================================
+
+// Crossfade from a rainbow to a gradient, then back, taking a second each way
+void crossfadeDemo() {
+	Color_t stops[3] = { Color(255, 0, 64), Color(0, 0, 0), Color(32, 255, 0) };
+	unsigned int n = numPixels();
+	unsigned long long start, elapsed;
+	Color_t *rainbow, *gradient;
+	int way;
+
+	rainbow = malloc(n * sizeof(Color_t));
+	gradient = malloc(n * sizeof(Color_t));
+	if(!rainbow || !gradient) {
+		free(rainbow);
+		free(gradient);
+		return;
+	}
+	fillWheel(0, n, 0, hueStep(n));
+	memcpy(rainbow, LEDBuffer, n * sizeof(Color_t));
+	fillGradientStops(0, n, stops, 3);
+	memcpy(gradient, LEDBuffer, n * sizeof(Color_t));
+
+	setFrameRate(60);
+	for(way = 0; way < 2; way++) {
+		start = nowNs();
+		do {
+			elapsed = nowNs() - start;
+			if(elapsed > 1000000000ULL) {
+				elapsed = 1000000000ULL;
 			}
+			blendPixels(0, n, way ? gradient : rainbow, way ? rainbow : gradient, BLEND_CROSSFADE,
+				elapsed * BLEND_ALPHA_MAX / 1000000000ULL);
 			show();
+		} while(elapsed < 1000000000ULL);
+	}
+	free(rainbow);
+	free(gradient);
+}
+
+void effectsDemo() {
+
+	// Default effects from the Arduino lib
+	colorWipe(Color(255, 0, 0), 50); // Red
+	colorWipe(Color(0, 255, 0), 50); // Green
+	colorWipe(Color(0, 0, 255), 50); // Blue
+	theaterChase(Color(127, 127, 127), 50); // White
+	theaterChase(Color(127,   0,   0), 50); // Red
+	theaterChase(Color(  0,   0, 127), 50); // Blue
+	rainbow(5);
+	rainbowCycle(5);
+	theaterChaseRainbow(50);
+
+	// Watermelon fade :)
+	runEffect(&watermelonEffect, Color(0, 0, 0), 1000000000ULL / 60);
+
+	// Random color fade
+	srand(time(NULL));
+	runEffect(&colorFadeEffect, Color(0, 0, 0), 1000000000ULL / 60);
+
+	// A comet, and a crossfade from a rainbow to a gradient and back
+	runEffect(&cometEffect, Color(255, 160, 32), 1000000000ULL / 100);
+	crossfadeDemo();
+
+	// Zones: the strip in quarters, each with its own effect and brightness, all at once
+	if(numPixels() >= 8) {
+		unsigned int quarter = numPixels() / 4;
+		clearSegments();
+		setSegmentEffect(addSegment(0, quarter), &rainbowCycleEffect, Color(0, 0, 0), 5000000);
+		setSegmentEffect(addSegment(quarter, quarter), &theaterChaseEffect, Color(127, 0, 127), 100000000);
+		setSegmentEffect(addSegment(quarter * 2, quarter), &colorWipeEffect, Color(0, 255, 0), 200000000);
+		setSegmentEffect(addSegment(quarter * 3, numPixels() - quarter * 3), &theaterChaseRainbowEffect, Color(0, 0, 0), 30000000);
+		setSegmentBrightness(0, 0.5);
+		setSegmentBrightness(3, 0.25);
+		runSegments();
+		clearSegments();
+	}
+}
+
+
+// How well do the worker threads share out rendering and encoding? This times a rainbow cycle
+// over the whole LED buffer, and encoding it, with 1 to MAX_WORKERS threads. Try a long strip
+// (--leds 10000, say). Nothing is sent.
+#define BENCH_FRAMES		200
+
+void benchThreads() {
+	unsigned long long start, renderNs, encodeNs, oneThreadNs = 0;
+	unsigned int n, f;
+	Effect_t effect;
+
+	printf("%u pixels, %d frames, %ld cores, %s encoder\n", numLEDs, BENCH_FRAMES, sysconf(_SC_NPROCESSORS_ONLN), encoderName);
+	printf("Threads   Render (us/frame)   Encode (us/frame)   Speedup\n");
+	for(n = 1; n <= MAX_WORKERS; n++) {
+		if(!setWorkerThreads(n)) {
+			break;
+		}
+		startEffect(&effect, &rainbowCycleEffect, 0, numLEDs, Color(0, 0, 0), 0);
+		renderNs = encodeNs = 0;
+		for(f = 0; f < BENCH_FRAMES; f++) {
+			start = nowNs();
+			stepEffect(&effect, start);
+			renderNs += nowNs() - start;
+
+			start = nowNs();
+			runParallel(encodeSlice, ctl->sample[backBuffer], 0, stripLength);
+			encodeNs += nowNs() - start;
+		}
+		if(n == 1) {
+			oneThreadNs = renderNs + encodeNs;
+		}
+		printf("%7u   %17.1f   %17.1f   %6.2fx\n", n, renderNs / 1e3 / BENCH_FRAMES, encodeNs / 1e3 / BENCH_FRAMES,
+			(double)oneThreadNs / (renderNs + encodeNs));
+	}
+	setWorkerThreads(1);
+}
+
+// Benchmarks
+// --------------------------------------------------------------------------------------------------
+// --bench (or ws2812-bench, which "make bench" builds and runs) times the parts of the driver the
+// CPU has to keep up with: encoding (what show() does before the DMA engine takes over), copying
+// encoded frames (what the frame cache and --play do), the pixel functions, and every built-in
+// effect at a few strip lengths. Nothing is sent, so the numbers don't include any time on the
+// wire, and it runs in the simulator on any Linux box.
+//
+// The output is for scripts. Lines starting with # are comments, and the rest are
+//		name <tab> pixels <tab> value <tab> unit
+// so you can keep the results from one version, and compare them with the next.
+
+// make passes the git version in, so results can be matched up with the code that made them
+#ifndef WS2812_VERSION
+#define WS2812_VERSION "unknown"
+#endif
+
+#define BENCH_PIXELS		10000			// The longest strip we time (main() makes sure there are this many)
+#define BENCH_TIME_NS		20000000ULL		// Time each thing for at least this long
+
+static const unsigned int benchLengths[] = { 24, 150, 1000, BENCH_PIXELS };
+static Effect_t benchEffect;
+static volatile unsigned int benchSink;		// So the compiler can't skip reading pixels
+
+// The encoding half of show(): everything but waiting for the wire and sending
+static void benchShow() {
+	changedRange.first = changedRange.end = 0;
+	encodeStale();
+	backBuffer = (backBuffer + 1) % NUM_BUFFERS;
+}
+
+// Call fn(n) over and over for at least BENCH_TIME_NS, and return how long it took each time
+static double benchTime(void (*fn)(unsigned int n), unsigned int n) {
+	unsigned long long start, elapsed;
+	unsigned long calls = 0;
+
+	fn(n);		// Warm up the caches
+	start = nowNs();
+	do {
+		fn(n);
+		calls++;
+		elapsed = nowNs() - start;
+	} while(elapsed < BENCH_TIME_NS);
+	return (double)elapsed / calls;
+}
+
+// Encode the first n pixels
+static void benchEncode(unsigned int n) {
+	growDirtyRanges(0, n);
+	benchShow();
+}
+
+// Copy n pixels' worth of encoded words from one DMA buffer to the other
+static void benchCopy(unsigned int n) {
+	memcpy(ctl->sample[1], ctl->sample[0], (n * 9 + 3) / 4 * sizeof(uint32_t));
+}
+
+// Each of these changes all n pixels, every time, so the setters have to mark them dirty
+static void benchSetPixelColor(unsigned int n) {
+	static unsigned char v;
+	unsigned int i;
+
+	v++;
+	for(i = 0; i < n; i++) {
+		setPixelColor(i, v, i, 0);
+	}
+}
+
+static void benchSetPixelColorT(unsigned int n) {
+	static unsigned char v;
+	unsigned int i;
+
+	v++;
+	for(i = 0; i < n; i++) {
+		setPixelColorT(i, Color(v, i, 0));
+	}
+}
+
+static void benchGetPixelColor(unsigned int n) {
+	unsigned int i, sum = 0;
+
+	for(i = 0; i < n; i++) {
+		sum += getPixelColor(i).g;
+	}
+	benchSink = sum;
+}
+
+static void benchSetPixels(unsigned int n) {
+	static Color_t frames[2][BENCH_PIXELS];
+	static unsigned int which;
+
+	which ^= 1;
+	frames[which][0].r++;
+	setPixels(0, n, frames[which]);
+}
+
+static void benchFillPixels(unsigned int n) {
+	static unsigned char v;
+
+	fillPixels(0, n, Color(++v, 0, 0));
+}
+
+// Frames a second for an effect on the first n pixels, where a frame is a tick and encoding what
+// it changed. Each run goes through the whole effect, from a black strip, and we do whole runs
+// until BENCH_TIME_NS is up, so every length is timed over the same ticks. (Timing whatever fits
+// in BENCH_TIME_NS from the start would only see the cheap beginning of a long colorWipe.) Returns
+// 0 for effects that are done after one frame, like solid: they have no frame rate to speak of.
+static double benchEffectRate(const EffectType_t *type, unsigned int n) {
+	unsigned long long start, elapsed = 0;
+	unsigned long frames = 0;
+	unsigned char running;
+
+	do {
+		clearLEDBuffer();
+		benchShow();
+		startEffect(&benchEffect, type, 0, n, Color(255, 160, 32), 0);
+		start = nowNs();
+		running = type->step(&benchEffect, 0);
+		benchShow();
+		frames++;
+		if(!running && frames == 1) {
+			return 0;
+		}
+		while(running) {
+			running = type->step(&benchEffect, 1);
+			benchShow();
+			frames++;
+		}
+		elapsed += nowNs() - start;
+	} while(elapsed < BENCH_TIME_NS);
+	return 1e9 * frames / elapsed;
+}
+
+static void benchPrint(const char *name, const char *variant, unsigned int pixels, double value, const char *unit) {
+	printf("%s%s%s\t%u\t%.3f\t%s\n", name, variant ? "_" : "", variant ? variant : "", pixels, value, unit);
+}
+
+void runBenchmarks() {
+	static const struct {
+		char *name;
+		void (*fn)(unsigned int n);
+	} pixelBenchmarks[] = {
+		{ "setPixelColor", benchSetPixelColor },
+		{ "setPixelColorT", benchSetPixelColorT },
+		{ "getPixelColor", benchGetPixelColor },
+		{ "setPixels", benchSetPixels },
+		{ "fillPixels", benchFillPixels },
+	};
+	void (*encoder)(unsigned int *, Color_t *, unsigned int) = encodePixels;
+	Encoder_t encoders[MAX_ENCODERS];
+	unsigned int i, e, l, n, numEncoders = listEncoders(encoders);
+	double rate;
+	const unsigned int numLengths = sizeof(benchLengths) / sizeof(benchLengths[0]);
+
+	printf("# ws2812-RPi benchmarks, version %s, built with gcc %s\n", WS2812_VERSION, __VERSION__);
+	printf("# %u pixels, %u strip(s), %s engine, %s encoder chosen, %u thread(s), %ld core(s)\n",
+		numLEDs, numStrips, engine->name, encoderName, numWorkers, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("# name\tpixels\tvalue\tunit\n");
+
+	// Encoding, with each encoder this CPU has, and with dithering
+	for(e = 0; e < numEncoders; e++) {
+		encodePixels = encoders[e].encode;
+		for(l = 0; l < numLengths; l++) {
+			n = benchLengths[l];
+			benchPrint("encode", encoders[e].name, n, benchTime(benchEncode, n) / n, "ns/pixel");
+		}
+	}
+	encodePixels = encoder;
+	if(setDithering(true)) {
+		// Dithering encodes the whole strip every frame, whatever changed, so there's only one length
+		benchPrint("encode", "dither", numLEDs, benchTime(benchEncode, numLEDs) / numLEDs, "ns/pixel");
+		setDithering(false);
+	}
+	for(l = 0; l < numLengths; l++) {
+		n = benchLengths[l];
+		benchPrint("sample_copy", NULL, n, benchTime(benchCopy, n) / n, "ns/pixel");
+	}
+
+	// The pixel functions
+	for(i = 0; i < sizeof(pixelBenchmarks) / sizeof(pixelBenchmarks[0]); i++) {
+		benchPrint(pixelBenchmarks[i].name, NULL, BENCH_PIXELS, benchTime(pixelBenchmarks[i].fn, BENCH_PIXELS) / BENCH_PIXELS, "ns/pixel");
+	}
+
+	// Effects, as many frames a second as the CPU could draw and encode, if the wire kept up. (Ones
+	// that only draw once aren't listed. fillPixels and encode cover what they cost.)
+	srand(1);				// colorFade picks random colors: the same ones every time, please
+	for(i = 0; builtinEffects[i]; i++) {
+		for(l = 0; l < numLengths; l++) {
+			n = benchLengths[l];
+			rate = benchEffectRate(builtinEffects[i], n);
+			if(rate > 0) {
+				benchPrint("effect", builtinEffects[i]->name, n, rate, "frames/s");
+			}
 		}
-		lastRed = red;
-		lastGreen = green;
-		lastBlue = blue;
 	}
+	clearLEDBuffer();
 }
 
+void usage(char *name) {
+	printf("Usage: %s [options]\n", name);
+	printf("  -s, --simulate     Don't touch the hardware. Send frames to a software simulation\n");
+	printf("                     of the DMA and PWM controllers (and the LEDs), and print\n");
+	printf("                     statistics on exit. Doesn't need root.\n");
+	printf("  -l, --leds N       How many LEDs are on each strip (default: %d)\n", DEFAULT_NUM_LEDS);
+	printf("  -d, --dual         Drive a second strip from GPIO19 (PWM channel 2), at the same\n");
+	printf("                     time as the first. Its pixels come after the first strip's.\n");
+	printf("  -e, --engine NAME  Send with pwm (GPIO18, the default) or pcm (GPIO21). One copy of\n");
+	printf("                     this program can run on each.\n");
+	printf("      --dma N        Use DMA channel N (default: 0 for pwm, 10 for pcm)\n");
+	printf("  -f, --daemon[=PATH]\n");
+	printf("                     Don't run the effects demo. Make a named pipe at PATH (default:\n");
+	printf("                     %s) and take commands from it: set, range, fill, clear,\n", DEFAULT_FIFO_PATH);
+	printf("                     brightness and show. See the Daemon section in the source.\n");
+	printf("  -m, --shm[=NAME]   Don't run the effects demo. Make a ring of frames in shared memory\n");
+	printf("                     called NAME (default: %s), and show the newest frame\n", WS2812_SHM_NAME);
+	printf("                     other processes put there. See ws2812-shm.h.\n");
+	printf("      --shm-stress[=SECONDS]\n");
+	printf("                     Like --shm, but also fork a producer that publishes %d frames a\n", SHM_STRESS_FPS);
+	printf("                     second for SECONDS (default: %d), then exit\n", DEFAULT_STRESS_SECONDS);
+	printf("  -o, --opc[=PORT]   Don't run the effects demo. Be an Open Pixel Control server on\n");
+	printf("                     TCP port PORT (default: %d)\n", OPC_DEFAULT_PORT);
+	printf("      --record FILE  Save every frame sent to the strip in FILE, ready to --play\n");
+	printf("      --play FILE    Don't run the effects demo. Send the frames recorded in FILE, with\n");
+	printf("                     the same timing. --repeat says how many times (default: forever).\n");
+	printf("  -c, --cache MB     Keep up to MB megabytes of encoded frames, and copy them instead\n");
+	printf("                     of encoding them again when they come round again (default: off)\n");
+	printf("  -t, --threads N    Share rendering and encoding between N threads (1-%d, default: 1)\n", MAX_WORKERS);
+	printf("      --bench-threads\n");
+	printf("                     Time rendering and encoding with 1 to %d threads, then exit\n", MAX_WORKERS);
+	printf("      --bench        Time encoding, the pixel functions and every effect, print the\n");
+	printf("                     results as tab-separated lines, then exit. Implies --leds %d or\n", BENCH_PIXELS);
+	printf("                     more. ws2812-bench (make bench) does this in the simulator.\n");
+	printf("      --dither       Dither between levels from frame to frame, sending frames as fast\n");
+	printf("                     as the wire allows, so dim colors fade smoothly\n");
+	printf("  -r, --repeat N     Run the effects demo N times, then exit (default: forever)\n");
+	printf("  -h, --help         Show this message\n");
+}
 
 int main(int argc, char **argv) { 
-	// Check "Single Instance"
-	int pid_file = open("/var/run/whatever.pid", O_CREAT | O_RDWR, 0666);
-	int rc = flock(pid_file, LOCK_EX | LOCK_NB);
-	if(rc) {
-	    if(EWOULDBLOCK == errno)
-	    {
-	        // another instance is running
-	        printf("Instance already running\n");
-	        exit(EXIT_FAILURE);
-	    }
+	static struct option longOptions[] = {
+		{ "simulate",	no_argument,		0, 's' },
+		{ "leds",		required_argument,	0, 'l' },
+		{ "dual",		no_argument,		0, 'd' },
+		{ "engine",		required_argument,	0, 'e' },
+		{ "dma",		required_argument,	0, 'D' },
+		{ "daemon",		optional_argument,	0, 'f' },
+		{ "shm",		optional_argument,	0, 'm' },
+		{ "shm-stress",	optional_argument,	0, 'S' },
+		{ "opc",		optional_argument,	0, 'o' },
+		{ "record",		required_argument,	0, 'R' },
+		{ "play",		required_argument,	0, 'P' },
+		{ "cache",		required_argument,	0, 'c' },
+		{ "threads",	required_argument,	0, 't' },
+		{ "bench-threads",	no_argument,	0, 'B' },
+		{ "bench",		no_argument,		0, 'K' },
+		{ "dither",		no_argument,		0, 'T' },
+		{ "repeat",		required_argument,	0, 'r' },
+		{ "help",		no_argument,		0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	int opt, i;
+	char *end;
+	long number;
+	int repeat = 0;
+	int leds = DEFAULT_NUM_LEDS;		// How many LEDs?
+	int strips = 1;
+	char *fifoPath = 0;
+	char *shmPath = 0;
+	int stressSeconds = 0;
+	int opcPort = 0;
+	char *recordPath = 0;
+	char *playPath = 0;
+	float cacheMB = 0;
+	int threads = 1;
+	int benchmark = false;
+	int benchAll = false;
+	int dither = false;
+
+#ifdef WS2812_BENCH
+	// ws2812-bench: run the benchmarks in the simulator, so it works anywhere
+	simulate = true;
+	benchAll = true;
+#endif
+
+	while((opt = getopt_long(argc, argv, "sl:de:f::m::o::c:t:r:h", longOptions, NULL)) != -1) {
+		switch(opt) {
+			case 's':
+				simulate = true;
+				break;
+			case 'l':
+				leds = atoi(optarg);
+				if(leds <= 0) {
+					printf("--leds needs a number above 0\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'd':
+				strips = 2;
+				break;
+			case 'e':
+				for(i = 0; i < sizeof(outputEngines) / sizeof(outputEngines[0]); i++) {
+					if(strcmp(optarg, outputEngines[i].name) == 0) {
+						engine = &outputEngines[i];
+						break;
+					}
+				}
+				if(i == sizeof(outputEngines) / sizeof(outputEngines[0])) {
+					printf("Unknown output engine: %s (pwm or pcm, please)\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'D':
+				number = strtol(optarg, &end, 10);
+				if(end == optarg || *end || number < 0 || number > 14) {
+					printf("--dma needs a number from 0 to 14\n");
+					exit(EXIT_FAILURE);
+				}
+				dmaChannel = number;
+				break;
+			case 'f':
+				fifoPath = optarg ? optarg : DEFAULT_FIFO_PATH;
+				break;
+			case 'm':
+				shmPath = optarg ? optarg : WS2812_SHM_NAME;
+				break;
+			case 'S':
+				shmPath = WS2812_SHM_NAME;
+				stressSeconds = optarg ? atoi(optarg) : DEFAULT_STRESS_SECONDS;
+				if(stressSeconds <= 0) {
+					printf("--shm-stress needs a number of seconds above 0\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'o':
+				opcPort = optarg ? atoi(optarg) : OPC_DEFAULT_PORT;
+				if(opcPort <= 0 || opcPort > 65535) {
+					printf("--opc needs a port number from 1 to 65535\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'R':
+				recordPath = optarg;
+				break;
+			case 'P':
+				playPath = optarg;
+				break;
+			case 'c':
+				cacheMB = atof(optarg);
+				if(cacheMB < 0) {
+					printf("--cache can't be below 0\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 't':
+				threads = atoi(optarg);
+				if(threads < 1 || threads > MAX_WORKERS) {
+					printf("--threads needs a number from 1 to %d\n", MAX_WORKERS);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'B':
+				benchmark = true;
+				break;
+			case 'K':
+				benchAll = true;
+				break;
+			case 'T':
+				dither = true;
+				break;
+			case 'r':
+				repeat = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	// A recording has to be played the way it was made, on the same engine and strips
+	if(playPath) {
+		openRecording(playPath);
+		leds = playHeader->stripLength;
+		strips = playHeader->numStrips;
+	}
+
+	// Check "Single Instance" per output engine (there's no hardware to fight over when simulating)
+	if(!simulate) {
+		int pid_file = open(engine->lockFile, O_CREAT | O_RDWR, 0666);
+		int rc = flock(pid_file, LOCK_EX | LOCK_NB);
+		if(rc) {
+		    if(EWOULDBLOCK == errno)
+		    {
+		        // another instance is running
+		        printf("Instance already running\n");
+		        exit(EXIT_FAILURE);
+		    }
+		}
 	}
 
 	// Catch all signals possible - it's vital we kill the DMA engine on process exit!
-	int i;
 	for (i = 0; i < 64; i++) {
 		struct sigaction sa;
 		memset(&sa, 0, sizeof(sa));
@@ -1417,24 +5463,63 @@ int main(int argc, char **argv) {
 	// Don't buffer console output
 	setvbuf(stdout, NULL, _IONBF, 0);
 
-	// How many LEDs?
-	numLEDs = 24;
-
 	// How bright? (Recommend 0.2 for direct viewing @ 3.3V)
 	setBrightness(DEFAULT_BRIGHTNESS);
 
 	// Init PWM generator and clear LED buffer
-	initHardware();
+	if(benchAll && leds * strips < BENCH_PIXELS) {
+		leds = (BENCH_PIXELS + strips - 1) / strips;
+	}
+	initHardware(leds, strips);
 	clearLEDBuffer();
+	setFrameCacheSize(cacheMB * 1024 * 1024);
+	setWorkerThreads(threads);
+	if(dither && !setDithering(true)) {
+		exit(EXIT_FAILURE);
+	}
+	if(recordPath) {
+		startRecording(recordPath);
+	}
 
-	// Show some effects
-	while(true) {
-		effectsDemo();
+	// Take orders from the pipe, frames from shared memory or Open Pixel Control clients (these
+	// don't return, except when stress testing), play a recording, or show some effects
+	if(fifoPath) {
+		runDaemon(fifoPath);
+	}
+	if(opcPort) {
+		runOPC(opcPort);
+	}
+	if(benchmark) {
+		benchThreads();
+	} else if(benchAll) {
+		runBenchmarks();
+	} else if(shmPath) {
+		runShm(shmPath, stressSeconds);
+	} else if(playPath) {
+		for(i=0; repeat == 0 || i < repeat; i++) {
+			playRecording();
+		}
+	} else {
+		for(i=0; repeat == 0 || i < repeat; i++) {
+			effectsDemo();
+		}
 	}
 
 	// Exit cleanly, freeing memory and stopping the DMA & PWM engines
 	// We trap all signals (including Ctrl+C), so even if you don't get here, it terminates correctly
-	terminate(0);
+	ws2812_wait();
+	if(!benchAll) {				// Scripts read the benchmark output, so don't add to it
+		dumpFrameStats();
+		if(simulate) {
+			dumpSimulator();
+		}
+	}
+	stopHardware();
 
+	// When simulating, fail if anything went out on the wire other than what we meant to send. Same
+	// if the shared memory stress test took a frame that was half one thing and half another.
+	if(shmTorn || (simulate && (simBadSymbols || simOverflows || simMismatches))) {
+		return EXIT_FAILURE;
+	}
 	return 0;
 }
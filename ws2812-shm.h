@@ -0,0 +1,126 @@
+// Set tabs to 4 spaces.
+
+// =================================================================================================
+// Shared memory frame ring for ws2812-RPi
+//
+// Pipes are fine for a few commands, but not for video. Run the driver with --shm, and it makes a
+// POSIX shared memory object (/ws2812, unless you give it another name) holding a small ring of
+// frames. Another process (one at a time, please) writes its pixels straight into the ring, and
+// every time the strip is ready for a frame, the driver takes the newest complete one. Frames the
+// strip didn't have time for are skipped. Publishing a frame doesn't make any system calls or copy
+// anything, so the producer can run as fast as it likes:
+//
+//		#include "ws2812-shm.h"
+//
+//		ws2812_shm_t *shm = ws2812_shm_open(WS2812_SHM_NAME);
+//		for(;;) {
+//			unsigned char *pixels = ws2812_shm_begin(shm);
+//			// Fill in shm->numLEDs pixels: 3 bytes each, in r, g, b order
+//			ws2812_shm_publish(shm);
+//		}
+//
+// Compile with: gcc producer.c -o producer -lrt
+//
+// Each slot in the ring has a sequence number, which is odd while the producer is writing it. The
+// driver checks it before and after it reads a frame, so if the producer comes all the way round
+// the ring and starts on the same slot meanwhile, the driver notices, and reads the newer frame
+// instead. If the driver is restarted, the old ring is gone - open it again.
+// =================================================================================================
+
+#ifndef WS2812_SHM_H
+#define WS2812_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WS2812_SHM_NAME			"/ws2812"
+#define WS2812_SHM_MAGIC		0x32383132		// "2812"
+#define WS2812_SHM_VERSION		1
+#define WS2812_SHM_SLOTS		4				// Frames in the ring
+#define WS2812_SHM_ALIGN		64				// Slots start on their own cache line
+
+typedef struct {
+	uint32_t magic;							// WS2812_SHM_MAGIC, once the driver has set everything up
+	uint32_t version;
+	uint32_t numLEDs;						// Pixels in each frame (all strips)
+	uint32_t frameBytes;					// Distance from one slot to the next
+	uint32_t latest;						// Newest complete frame (0 = none yet). Frame n is in slot n % WS2812_SHM_SLOTS.
+	uint32_t sequence[WS2812_SHM_SLOTS];	// Twice the number of the frame in each slot, minus 1 while it's being written
+} ws2812_shm_t;
+
+#define WS2812_SHM_HEADER_BYTES	((sizeof(ws2812_shm_t) + WS2812_SHM_ALIGN - 1) & ~(WS2812_SHM_ALIGN - 1))
+
+// Bytes in one slot (3 per pixel, rounded up to a cache line)
+static inline uint32_t ws2812_shm_frame_bytes(unsigned int numLEDs) {
+	return (numLEDs * 3 + WS2812_SHM_ALIGN - 1) & ~(WS2812_SHM_ALIGN - 1);
+}
+
+// Bytes in the whole shared memory object
+static inline size_t ws2812_shm_size(unsigned int numLEDs) {
+	return WS2812_SHM_HEADER_BYTES + (size_t)ws2812_shm_frame_bytes(numLEDs) * WS2812_SHM_SLOTS;
+}
+
+// The pixels in one slot
+static inline unsigned char *ws2812_shm_slot(ws2812_shm_t *shm, unsigned int slot) {
+	return (unsigned char *)shm + WS2812_SHM_HEADER_BYTES + (size_t)shm->frameBytes * slot;
+}
+
+// Map the driver's ring. Returns NULL (with errno set) if it isn't there, or isn't ready yet.
+static inline ws2812_shm_t *ws2812_shm_open(const char *name) {
+	struct stat st;
+	ws2812_shm_t *shm;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0) {
+		return NULL;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(ws2812_shm_t)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED) {
+		return NULL;
+	}
+	if(__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != WS2812_SHM_MAGIC
+			|| shm->version != WS2812_SHM_VERSION || st.st_size < ws2812_shm_size(shm->numLEDs)) {
+		munmap(shm, st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+	return shm;
+}
+
+static inline void ws2812_shm_close(ws2812_shm_t *shm) {
+	munmap(shm, ws2812_shm_size(shm->numLEDs));
+}
+
+// Start a frame. Returns the slot to write the pixels into (shm->numLEDs of them, 3 bytes each, r g b).
+static inline unsigned char *ws2812_shm_begin(ws2812_shm_t *shm) {
+	uint32_t frame = shm->latest + 1;		// Only we write latest, so we don't need to be careful reading it
+	uint32_t slot = frame % WS2812_SHM_SLOTS;
+
+	// Odd = being written. The fence keeps the pixels from being written before the driver can see that.
+	__atomic_store_n(&shm->sequence[slot], frame * 2 - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return ws2812_shm_slot(shm, slot);
+}
+
+// Finish the frame started by ws2812_shm_begin(), and make it the newest one
+static inline void ws2812_shm_publish(ws2812_shm_t *shm) {
+	uint32_t frame = shm->latest + 1;
+	uint32_t slot = frame % WS2812_SHM_SLOTS;
+
+	__atomic_store_n(&shm->sequence[slot], frame * 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&shm->latest, frame, __ATOMIC_RELEASE);
+}
+
+#endif